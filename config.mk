@@ -1,14 +1,14 @@
 # Uncomment to statically link with musl
 #CC      = musl-gcc
-#LDFLAGS = -lm -static -s
-#CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -Ofast \
+#LDFLAGS = -lm -lrt -pthread -static -s
+#CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -pthread -Ofast \
 
 CC      = gcc
-LDFLAGS = -lm -s
-CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -O3
+LDFLAGS = -lm -lrt -pthread -s
+CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -pthread -O3
 
-#LDFLAGS = -lm
-#CFLAGS = -D_GNU_SOURCE -g -static -std=c11 -pedantic -Wall -Wextra -Wunused-macros \
+#LDFLAGS = -lm -lrt -pthread
+#CFLAGS = -D_GNU_SOURCE -g -static -std=c11 -pthread -pedantic -Wall -Wextra -Wunused-macros \
 	-Wno-missing-braces -Wno-missing-field-initializers -Wformat=2 \
 	-Wswitch-default -Wswitch-enum -Wcast-align -Wpointer-arith \
 	-Wbad-function-cast -Wstrict-overflow=5 -Wstrict-prototypes -Winline \
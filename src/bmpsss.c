@@ -1,11 +1,28 @@
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <aio.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tgmath.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -13,21 +30,63 @@
 #define DIB_HEADER_SIZE      40
 #define PALETTE_SIZE         1024
 #define PIXEL_ARRAY_OFFSET   (BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE)
+#define UNUSED1_OFFSET       6
 #define UNUSED2_OFFSET       8
 #define WIDTH_OFFSET         18
 #define HEIGHT_OFFSET        22
 #define BITS_PER_PIXEL       8
 #define PRIME                257
 #define DEFAULT_SEED         691
+#define DEFAULT_NAME         "shadow%n.bmp"
+#define DEFAULT_SEQNAME      "shadow%n.seq"
 #define RIGHTMOST_BIT_ON(x)  ((x) |= 0x01)
 #define RIGHTMOST_BIT_OFF(x) ((x) &= 0xFE)
 #define DIR_MAX              (PATH_MAX - NAME_MAX)
+#define MAX_GLOBS            16
+#define BATCH_MAX_ARGS       64
+#define KEYSTREAM_LCG48      1 /* engine id of the generator in lcgnext() */
+#define LCG_MULTIPLIER       25214903917ULL
+#define LCG_INCREMENT        11ULL
+#define LCG_MASK             ((1ULL << 48) - 1)
+#define LCG_PARALLEL_MIN     (1 << 20) /* bytes below which lcgfill() runs in one thread */
+#define KEYCACHE_ENTRIES     8
+#define KEYCACHE_MAGIC       "BKSC"
+#define SHADOW_MULTI         0x4000 /* shadow hides the shares of several secrets */
+#define SHADOW_TILED         0x8000 /* secret pixels taken in tile order */
+#define SHADOW_1BIT          0x1000 /* secret of 1 bit per pixel, shared packed */
+#define SHADOW_4BIT          0x2000 /* secret of 4 bits per pixel, shared packed */
+#define SHADOWNUM(x)         ((x) & 0x0FFF)
+#define SHADOWDEPTH(x)       ((x) & SHADOW_1BIT ? 1 : (x) & SHADOW_4BIT ? 4 : BITS_PER_PIXEL)
+#define MULTI_MAGIC          "BSSM"
+#define MULTI_MAX_SECRETS    64
+#define MULTI_HEADER_SIZE    5  /* magic and count */
+#define MULTI_ENTRY_SIZE     14 /* width, height, offset and seed */
+#define MULTI_INDEX_MAX      (MULTI_HEADER_SIZE + MULTI_ENTRY_SIZE * MULTI_MAX_SECRETS)
+#define KERNEL_LANES         64 /* blocks evaluated side by side */
+#define IOPRIO_CLASS_SHIFT   13 /* ioprio_set(2); glibc has no wrapper */
+#define IOPRIO_CLASS_BE      2
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_WHO_PROCESS   1
+#define HIST_BUCKETS         24     /* latency buckets, doubling from HIST_MIN */
+#define HIST_MIN             1e-4   /* seconds */
+#define DIRECT_ALIGN         4096
+#define DIRECT_CHUNK         (1 << 22)
+#define PARALLEL_IO_CHUNK    (1 << 22) /* bytes of each pread or pwrite of parallelio() */
+#define PARALLEL_IO_MIN      (1 << 24) /* pixel arrays smaller are moved by one thread */
+#define MAX_THREADS          256
+#define MAX_NODES            64
+#define TILE_SIDE            16
+#define STREAM_BLOCKS        4096 /* blocks buffered by a Sharer or Revealer */
+#define DIGEST_MAGIC         "BSSD"
+#define DIGEST_RANGE         4096 /* blocks covered by each digest hash */
+#define SHAREKEY_CHECK_SEED  0x5EED5EED5EED5EEDULL /* seeds the second hash of a cached share */
+#define COVERINDEX_EVENTS    (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
 
 typedef struct {
     uint8_t  id[2];   /* magic number to identify the BMP format */
     uint32_t size;    /* size of the BMP file in bytes */
     uint16_t unused1; /* key (seed) */
-    uint16_t unused2; /* shadow number */
+    uint16_t unused2; /* shadow number, and SHADOW_* layout flags */
     uint32_t offset;  /* starting address of the pixel array (bitmap data) */
 } BMPheader;
 
@@ -51,21 +110,349 @@ typedef struct {
     DIBheader dibheader;             /* 40 bytes DIB header */
     uint8_t   palette[PALETTE_SIZE]; /* color palette; mandatory for depth <= 8 */
     uint8_t   *imgpixels;            /* array of bytes representing each pixel */
+    uint8_t   *preamble;             /* the offset bytes before the pixels, as
+                                      * read from the file; NULL if built */
 } Bitmap;
 
+/* State of the 48-bit linear congruential generator behind the keystreams.
+ * Each stream owns one, so any number can be generated at once */
+typedef struct {
+    uint64_t state;
+} Lcg;
+
+/* range of a keystream filled by one lcgfill() thread */
+typedef struct {
+    Lcg     start; /* generator at buf[0] */
+    uint8_t *buf;
+} Lcgfill;
+
+/* prefix of the keystream of a seed, extended on demand */
+typedef struct {
+    uint16_t seed;
+    Lcg      lcg;    /* generator right after the last cached byte */
+    size_t   len;    /* amount of cached bytes */
+    uint8_t  *bytes;
+    uint8_t  *map;   /* mapping of the on-disk cache file, if any */
+    size_t   maplen;
+} Keystream;
+
+/* header of an on-disk keystream cache file, followed by the bytes. Stored in
+ * native byte order, so cache files are not meant to be shared across hosts */
+typedef struct {
+    char     magic[4];
+    uint32_t engine;
+    int64_t  state;
+    uint64_t len;
+} KeycacheHeader;
+
+/* File being written, either through stdio or, with --direct, with O_DIRECT
+ * from two aligned chunks: one is filled while the other is being written.
+ * It is unnamed, or named tmppath, until it is complete */
+typedef struct {
+    FILE         *fp;
+    int          fd;
+    const char   *path;
+    char         *tmppath;
+    uint8_t      *chunk[2];
+    struct aiocb cb[2];
+    bool         pending[2];
+    size_t       cur;  /* chunk being filled */
+    size_t       fill; /* bytes in it */
+    off_t        off;  /* file offset of the chunk being filled */
+} Output;
+
+/* range of a parallelfor() run by one thread */
+typedef struct {
+    void   (*fn)(void *arg, size_t from, size_t to);
+    void   *arg;
+    size_t from;
+    size_t to;
+    int    cpu;  /* cpu to pin the thread to, or -1 */
+    int    ran;  /* cpu the thread ended on */
+} Worker;
+
+/* share of a parallelio() of one thread: every stride-th chunk from first */
+typedef struct {
+    int     fd;
+    uint8_t *buf;
+    size_t  len;
+    off_t   off;    /* file offset of buf */
+    bool    write;
+    size_t  first;
+    size_t  stride;
+    bool    failed;
+} Iojob;
+
+/* CPUs of a NUMA node */
+typedef struct {
+    int    id;     /* number of the node in sysfs */
+    int    *cpus;
+    size_t ncpus;
+} Node;
+
+/* called with the pixels [from, from + len) of the i-th shadow (from 0) */
+typedef void (*Stripefn)(void *ctx, size_t i, const uint8_t *pixels, size_t from, size_t len);
+/* called with the secret pixels [from, from + len) */
+typedef void (*Rowsfn)(void *ctx, const uint8_t *pixels, size_t from, size_t len);
+
+/* Shares a secret pushed in pieces of any length, such as rows, as they come:
+ * each stripe of STREAM_BLOCKS blocks is shared once complete, and handed to
+ * emit a shadow at a time. Only a stripe is held at once */
+typedef struct {
+    uint16_t k;
+    uint16_t n;
+    uint16_t seed;
+    size_t   size; /* pixel bytes of the whole secret */
+    size_t   done; /* secret bytes shared so far */
+    uint8_t  *buf; /* the stripe being filled */
+    size_t   fill;
+    uint8_t  **out;
+    Stripefn emit;
+    void     *ctx;
+} Sharer;
+
+/* The reverse of a Sharer: k stego images are pushed in stripes of any
+ * length, and rows of the secret are handed to emit as soon as all of them
+ * hold the same blocks */
+typedef struct {
+    uint16_t k;
+    uint16_t seed;
+    size_t   size;     /* pixel bytes of the whole secret */
+    size_t   done;     /* blocks revealed so far */
+    Bitmap   *shadows; /* k shadow headers, with a stripe as imgpixels */
+    Bitmap   **ptrs;
+    size_t   *fill;    /* bytes in the stripe of each shadow */
+    int      *inv;
+    uint8_t  *out;
+    Rowsfn   emit;
+    void     *ctx;
+} Revealer;
+
+/* arguments of shareworker() and revealworker() */
+typedef struct {
+    uint8_t *coeff;
+    uint16_t k;
+    uint16_t n;
+    uint8_t  **out;
+    size_t   outoff;
+} Sharejob;
+
+typedef struct {
+    Bitmap    **shadows;
+    uint16_t  k;
+    const int *inv;
+    size_t    from;
+    uint8_t   *out;
+} Revealjob;
+
+/* identity of a file's contents, as far as stat(2) can tell */
+typedef struct {
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+} Fileid;
+
+/* regular file of a watched cover directory, with its header fields */
+typedef struct {
+    char     *name;
+    char     *path;
+    bool     isbmp;
+    off_t    size;
+    uint32_t width;
+    uint32_t height;
+} Coverentry;
+
+/* Regular files of a cover directory, in the order readdir() listed them, kept
+ * up to date through inotify. wd is -1 when the directory has to be rescanned */
+typedef struct {
+    char       *dir;
+    int        wd;
+    Coverentry *entries;
+    size_t     len;
+    size_t     cap;
+} Coverindex;
+
+typedef struct Cacheentry {
+    struct Cacheentry *prev;
+    struct Cacheentry *next;
+    uint8_t           *key;
+    size_t            keylen;
+    Bitmap            *bmp;
+    size_t            size; /* bytes accounted for bmp */
+} Cacheentry;
+
+/* size-bounded LRU of bitmaps, keyed by arbitrary bytes */
+typedef struct {
+    Cacheentry *head; /* most recently used */
+    Cacheentry *tail; /* least recently used */
+    size_t     size;
+    size_t     maxsize;
+    uint64_t   hits;
+    uint64_t   misses;
+} Bitmapcache;
+
+/* Header of a digest file, followed by one hash of the secret pixels per range
+ * of DIGEST_RANGE blocks. Native byte order, like the keystream caches */
+typedef struct {
+    char     magic[4];
+    uint16_t k;
+    uint16_t n;
+    uint16_t seed;
+    uint16_t pad;
+    uint32_t size;   /* secret pixel array size */
+    uint32_t ranges;
+} DigestHeader;
+
+/* what identifies a shadow taking part in a recovery */
+typedef struct {
+    uint16_t shadownumber;
+    uint16_t seed;
+    uint32_t pad;   /* keeps the struct free of unset padding bytes */
+    uint64_t hash;  /* of the shadow bytes */
+    uint64_t check; /* of the shadow bytes again, under another seed */
+} Sharekey;
+
+/* key of revealcache: the recovery parameters and the shares used */
+typedef struct {
+    uint32_t width;
+    int32_t  height;
+    uint32_t k;
+    uint32_t flags;  /* SHADOW_* layout flags */
+    Sharekey shares[];
+} Revealkey;
+
+typedef struct {
+    bool     dflag;
+    bool     rflag;
+    bool     kflag;
+    bool     wflag;
+    bool     hflag;
+    bool     nflag;
+    bool     secretflag;
+    uint16_t seed;
+    uint16_t k;
+    uint16_t n;
+    uint32_t width;
+    int32_t  height;
+    bool     uflag;
+    bool     reshareflag;
+    bool     tile;
+    uint16_t newk;
+    char     *covers;
+    char     *filename;
+    char     *secrets[MULTI_MAX_SECRETS];
+    size_t   nsecrets;
+    uint16_t index;  /* secret to recover from a multi-secret shadow, from 1 */
+    bool     sequence; /* --secret names the frames of a sequence, with %n */
+    char     *dir;
+    char     *digest;
+} Options;
+
+enum { STAGE_READ, STAGE_KERNEL, STAGE_WRITE, STAGES };
+
+/* latency histogram of one series, with log2 buckets: buckets[i] counts the
+ * observations in (HIST_MIN * 2^(i-1), HIST_MIN * 2^i] seconds */
+typedef struct {
+    char     name[32];
+    char     labels[96];
+    uint64_t buckets[HIST_BUCKETS + 1]; /* the last one is +Inf */
+    uint64_t count;
+    double   sum;
+} Histogram;
+
+/* what --metrics reports */
+typedef struct {
+    uint64_t  bytesread;
+    uint64_t  byteswritten;
+    uint64_t  keystreamhits;
+    uint64_t  keystreammisses;
+    uint64_t  rejected;
+    uint64_t  late;
+    size_t    queued;
+    double    stage[STAGES]; /* seconds spent by the current job */
+    Histogram *hists;
+    size_t    nhists;
+} Stats;
+
+/* line of a batch waiting to run */
+typedef struct {
+    char   *line;  /* holds the strings of args */
+    char   *args[BATCH_MAX_ARGS];
+    int    nargs;
+    bool   isjob;  /* false for a line with only options */
+    long   priority;
+    double deadline; /* monotonic seconds; 0 if none */
+    size_t seq;      /* order of arrival */
+} Job;
+
+typedef enum { SYNC_NONE, SYNC_BATCH, SYNC_FS, SYNC_FILE } Syncmode;
+
+/* globals a job line of a batch may set. Only lines with options alone apply
+ * to the jobs after them, so runqueued() puts these back after every job */
+typedef struct {
+    size_t     nthreads;
+    bool       pinthreads;
+    bool       placement;
+    bool       directio;
+    long       prefetch;
+    Syncmode   syncmode;
+    const char *nametemplate;
+    double     ratelimit;
+    bool       recursive;
+    size_t     nincludes;
+    size_t     nexcludes;
+} Jobsettings;
+
 typedef bool (*fn)(FILE *, uint16_t, uint32_t);
+typedef bool (*Visitfn)(void *arg, const char *path); /* false to stop */
+
+/* shadow found by getshadowfilenames(), with what reading it costs */
+typedef struct {
+    char     *path;
+    uint16_t num;     /* unused2: the shadow number and layout flags */
+    uint16_t seed;
+    bool     remote;  /* on a network file system */
+    size_t   missing; /* bytes to read that aren't in the page cache */
+    size_t   order;   /* order in which it was found */
+} Candidate;
+
+/* state of getshadowfilenames() while walking */
+typedef struct {
+    uint16_t  k;
+    uint32_t  size;
+    Candidate *cands;
+    size_t    len;
+} Shadowwalk;
+
+/* state of getvalidfilenames() while walking */
+typedef struct {
+    fn       isvalid;
+    uint16_t k;
+    uint16_t n;
+    uint32_t size;
+    char     **filenames;
+    size_t   len;
+} Validwalk;
 
 /* prototypes */
-static void     setseed(int64_t s);
-static int      nextbyte(void);
-static int      countfiles(const char *dirname);
+static void     lcgseed(Lcg *g, int64_t seed);
+static uint8_t  lcgnext(Lcg *g);
+static void     lcgjump(Lcg *g, uint64_t steps);
+static void     lcgworker(void *arg, size_t from, size_t to);
+static void     lcgfill(Lcg *g, uint8_t *buf, size_t len);
+static int      countfiles(const char *dirname, off_t minsize);
+static bool     countvisit(void *arg, const char *path);
+static bool     isincluded(const char *rel, bool isdir);
+static bool     walkfiles(const char *dir, const char *rel, off_t minsize, Visitfn visit, void *arg);
+static off_t    minsize(off_t pixels, uint16_t k);
+static bool     useindex(void);
 static void     usage(void);
 static uint32_t get32bitsfromheader(FILE *fp, int offset);
 static uint32_t bmpfilewidth(FILE *fp);
 static uint32_t bmpfileheight(FILE *fp);
 static uint32_t bmpimagesize(const Bitmap *bp);
 static void     initpalette(uint8_t palette[static PALETTE_SIZE]);
-static Bitmap   *newbitmap(uint32_t width, int32_t height, uint16_t seed);
 static void     freebitmap(Bitmap *bp);
 static Bitmap   *newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum, uint32_t pixelarraysize);
 static void     changeheaderendianness(BMPheader *h);
@@ -74,33 +461,179 @@ static void     readbmpheader(Bitmap *bp, FILE *fp);
 static void     writebmpheader(const Bitmap *bp, FILE *fp);
 static void     readdibheader(Bitmap *bp, FILE *fp);
 static void     writedibheader(const Bitmap *bp, FILE *fp);
+static uint8_t  *readdirect(const char *filename, size_t *size);
 static Bitmap   *bmpfromfile(const char *filename);
+static Bitmap   *bmpfromfp(FILE *fp);
+static Output   *outopen(const char *filename);
+static void     outwait(Output *out, size_t i);
+static void     outsubmit(Output *out);
+static void     outwrite(Output *out, const void *buf, size_t len);
+static bool     outparallel(const Output *out, size_t len);
+static void     outwriteat(Output *out, const void *buf, size_t len, off_t off);
+static void     *ioworker(void *arg);
+static bool     parallelio(int fd, uint8_t *buf, size_t len, off_t off, bool write);
+static void     outwritepreamble(Output *out, const Bitmap *bp);
+static size_t   preamblesize(const Bitmap *bp);
+static void     outclose(Output *out);
+static int      createfile(const char *path, int flags);
+static char     *tmpname(const char *path);
+static void     pathdir(const char *path, char *dir);
+static void     syncdir(const char *path);
+static void     syncclose(FILE *fp, const char *path);
+static void     leaveunsynced(const char *path);
+static void     syncoutputs(void);
 static bool     isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize);
 static bool     kdivisiblesize(FILE *fp, uint16_t k);
 static void     bmptofile(const Bitmap *bp, const char *filename);
+static void     tilebitmap(Bitmap *bp, bool untile);
 static void     findclosestpair(uint32_t x, uint32_t *width, int32_t *height);
 static Bitmap   *newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber);
-static Bitmap   **formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed);
-static void     findcoefficients(int **mat, uint16_t k);
+static void     shareblock(uint8_t *coeff, uint16_t k, uint16_t n, uint16_t *pixels);
+static void     sharekernel(uint8_t *coeff, size_t nblocks, uint16_t k, uint16_t n, uint8_t **out, size_t outoff);
+static void     shareworker(void *arg, size_t from, size_t to);
+static void     shareblocks(uint8_t *coeff, size_t nblocks, uint16_t k, uint16_t n, uint8_t **out, size_t outoff);
+static size_t   blockcount(size_t size, uint16_t k);
+static void     sharebytes(uint8_t *secret, size_t size, uint16_t k, uint16_t n, uint8_t **out, size_t outoff);
+static Bitmap   **formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed, uint16_t flags);
+static int      *invertvandermonde(Bitmap **shadows, uint16_t k);
+static void     revealkernel(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t to, uint8_t *out);
+static void     revealworker(void *arg, size_t from, size_t to);
+static void     revealblocks(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t to, uint8_t *out);
+static void     revealbytes(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t size, uint8_t *out);
+static void     readtopology(void);
+static int      cpunode(int cpu);
+static void     *runworker(void *arg);
+static void     parallelfor(size_t nitems, void (*fn)(void *, size_t, size_t), void *arg);
 static Bitmap   *revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k);
-static void     hideshadow(Bitmap *bp, const Bitmap *shadow);
+static void     expandname(char *buf, const char *template, uint16_t num);
+static void     throttle(size_t len);
+static void     setidle(bool idle);
+static void     hidebytes(const Bitmap *cover, const uint8_t *bytes, uint32_t len, uint16_t seed, uint16_t shadnum);
+static void     hidebytesto(Output *out, const Bitmap *cover, const uint8_t *bytes, uint32_t len,
+                        uint16_t seed, uint16_t shadnum);
+static void     hideshadow(const Bitmap *cover, const Bitmap *shadow);
+static void     retrievebytes(const Bitmap *bp, uint8_t *bytes, uint32_t from, uint32_t len);
+static void     unhidebytes(const uint8_t *stego, uint8_t *bytes, size_t len);
 static Bitmap   *retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k);
 static bool     isbmp(FILE *fp);
 static bool     isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize);
 static bool     isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter);
+static bool     validvisit(void *arg, const char *path);
 static char     **getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size);
 static char     **getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size);
+static bool     isremote(const char *path);
+static size_t   missingbytes(const char *path, size_t len);
+static bool     shadowvisit(void *arg, const char *path);
+static int      candidatecmp(const void *a, const void *b);
+static Candidate *findshadows(const char *dir, uint16_t k, uint32_t size, size_t *len);
 static char     **getshadowfilenames(const char *dir, uint16_t k, uint32_t size);
-static void     distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed);
+static void     validatecover(Coverentry *e);
+static void     indexcover(Coverindex *ci, const char *name);
+static void     unindexcover(Coverindex *ci, const char *name);
+static void     scancoverindex(Coverindex *ci);
+static void     dropcoverindex(Coverindex *ci);
+static void     updatecoverindexes(void);
+static Coverindex *coverindex(const char *dir);
+static char     **getindexedfilenames(Coverindex *ci, uint16_t k, uint16_t n, uint32_t size);
+static void     distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed,
+                        const char *digestpath, bool tile);
+static uint64_t *digestranges(const Bitmap *bp, uint16_t k, uint32_t ranges);
+static void     writedigest(const char *path, const DigestHeader *h, const uint64_t *hashes);
+static void     patchshadow(const char *path, const uint8_t *pixels, uint32_t from, uint32_t to);
+static void     updateimage(const char *dir, const char *imgpath, const char *digestpath, uint16_t k);
+static void     putle(uint8_t *p, uint32_t value, size_t nbytes);
+static uint32_t getle(const uint8_t *p, size_t nbytes);
+static void     distributeimages(const char *dir, char **imgpaths, size_t count, uint16_t k, uint16_t n, uint16_t seed);
+static void     recoverimageat(const char *dir, const char *filename, uint16_t k, uint16_t index);
+static void     distributesequence(const char *dir, const char *template, uint16_t k, uint16_t n, uint16_t seed);
+static void     recoversequence(const char *dir, const char *template, uint32_t width, int32_t height,
+                        uint16_t k);
+static Sharer   *newsharer(uint16_t k, uint16_t n, uint16_t seed, size_t size, Stripefn emit, void *ctx);
+static void     flushsharer(Sharer *s);
+static void     sharerpush(Sharer *s, const uint8_t *pixels, size_t len);
+static void     finishsharer(Sharer *s);
+static Revealer *newrevealer(uint16_t k, const uint16_t *shadownums, uint16_t seed, size_t size,
+        Rowsfn emit, void *ctx);
+static size_t   revealerpush(Revealer *r, size_t i, const uint8_t *stego, size_t len);
+static void     freerevealer(Revealer *r);
+static void     resharerows(void *ctx, const uint8_t *pixels, size_t from, size_t len);
+static void     resharestripe(void *ctx, size_t i, const uint8_t *pixels, size_t from, size_t len);
+static void     reshareimage(const char *dir, const char *coverdir, uint32_t width, int32_t height,
+                        uint16_t k, uint16_t newk, uint16_t n, uint16_t seed);
 static void     recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k);
 static uint32_t calculatepixelarraysize(uint32_t width, int32_t height);
+static uint32_t secretsize(uint32_t width, int32_t height, uint16_t flags);
+static uint32_t shadowpalette(uint16_t flags);
+static uint32_t shadowsize(uint32_t size, uint16_t k, uint16_t flags);
+static off_t    sharedbytes(const char *path);
+static size_t   palettesize(const Bitmap *bp);
+static uint16_t packbitmap(const Bitmap *bp);
+static void     unpackbitmap(Bitmap *bp, uint16_t flags, const uint8_t *palette);
 static void     decreasecoeff(uint8_t *coeff);
-static uint8_t  *randomtable(uint32_t tablesize, uint16_t seed);
+static void     cacheunlink(Bitmapcache *c, Cacheentry *e);
+static Bitmap   *cacheget(Bitmapcache *c, const void *key, size_t keylen);
+static void     cacheput(Bitmapcache *c, const void *key, size_t keylen, Bitmap *bmp);
+static Bitmap   *coverfromfile(const char *filename);
+static void     freecover(Bitmap *bp);
+static void     prefetchcover(char **paths, size_t i, size_t n);
+static void     prefetchfile(const char *path);
+static int      sharekeycmp(const void *a, const void *b);
+static void     extendkeystream(Keystream *ks, size_t len);
+static void     extendkeystreamfile(Keystream *ks, size_t len);
+static const uint8_t *keystream(uint16_t seed, size_t len);
+static void     dropkeystream(Keystream *ks);
+static void     setkeycache(const char *dir);
 static void     xorbmpwithrandomtable(Bitmap *bmp, uint16_t seed);
+static void     initoptions(Options *o);
+static void     parseargs(Options *o, int argc, char *argv[]);
+static void     runjob(Options *o);
+static double   monotonic(void);
+static size_t   footprint(const Options *o);
+static Job      *readjob(FILE *fp);
+static size_t   nextjob(const Job *queue, size_t len);
+static void     observe(const char *name, const char *labels, double seconds);
+static void     recordjob(const Options *o, double seconds);
+static void     writehistogram(FILE *fp, const Histogram *h);
+static void     writemetrics(void);
+static void     dropglobs(size_t nincl, size_t nexcl);
+static Jobsettings getsettings(void);
+static void     putsettings(const Jobsettings *js);
+static void     runqueued(Job *job);
+static void     runbatch(const char *path);
 
 /* globals */
 static const char *argv0;           /* program name for usage() */
-static int64_t    rseed;            /* seed to use for the random table */
+static size_t     nthreads = 1;     /* threads for the share and reveal kernels */
+static bool       pinthreads;       /* pin each thread to a cpu of its node */
+static bool       placement;        /* report where each thread ran */
+static bool       directio;         /* bypass the page cache for bitmaps */
+static long       prefetch = -1;    /* covers read ahead; -1 sizes it from free memory */
+static Syncmode   syncmode;
+static char       **unsynced;       /* outputs left for syncoutputs() */
+static size_t     nunsynced;
+static const char *nametemplate = DEFAULT_NAME;
+static const char *jobid;           /* %j of nametemplate; the pid if NULL */
+static size_t     jobseq;           /* number of the job within a batch */
+static double     ratelimit;        /* bytes of I/O per second; 0 for no limit */
+static size_t     memlimit;         /* bytes a batch job may take; 0 for no limit */
+static const char *metricspath;     /* file rewritten with stats after each job */
+static Stats      stats;
+static bool       recursive;        /* look for images in subdirectories too */
+static char       *includes[MAX_GLOBS]; /* globs an image path must match */
+static size_t     nincludes;
+static char       *excludes[MAX_GLOBS]; /* globs no image path may match */
+static size_t     nexcludes;
+static Node       nodes[MAX_NODES];
+static size_t     nnodes;
+static const char *keycachedir;     /* directory of on-disk keystream caches */
+static const char *batchpath;       /* file with one job per line */
+static Keystream  keycache[KEYCACHE_ENTRIES];
+static size_t     keycachenext;     /* next entry to evict */
+static Bitmapcache covercache;      /* decoded covers, if maxsize != 0 */
+static Bitmapcache revealcache;     /* recovered secrets, if maxsize != 0 */
+static int        inotifyfd = -1;   /* watches cover dirs in batch mode */
+static Coverindex *coverindexes;
+static size_t     ncoverindexes;
 static const int  modinv[PRIME] = { /* modular multiplicative inverses */
     0, 1, 129, 86, 193, 103, 43, 147, 225, 200, 180, 187, 150, 178, 202, 120,
     241, 121, 100, 230, 90, 49, 222, 190, 75, 72, 89, 238, 101, 195, 60, 199,
@@ -120,43 +653,189 @@ static const int  modinv[PRIME] = { /* modular multiplicative inverses */
     57, 32, 110, 214, 154, 64, 171, 128, 256
 };
 
+/* counts the BMP files of at least minsize bytes in dirname, or in its index
+ * when there is one */
 int
-countfiles(const char *dirname) {
-    struct dirent *d;
+countfiles(const char *dirname, off_t minsize) {
     int filecount = 0;
-    DIR *dp = xopendir(dirname);
 
-    while ((d = readdir(dp))) {
-        if (d->d_type == DT_REG) /* If the entry is a regular file */
-            filecount++;
+    if (useindex()) {
+        Coverindex *ci = coverindex(dirname);
+
+        for (size_t i = 0; i < ci->len; i++)
+            filecount += ci->entries[i].isbmp && ci->entries[i].size >= minsize;
+        return filecount;
     }
-    xclosedir(dp);
+    walkfiles(dirname, NULL, minsize, countvisit, &filecount);
 
     return filecount;
 }
 
+/* counts the BMP files; the size was already checked by walkfiles() */
+bool
+countvisit(void *arg, const char *path) {
+    FILE *fp = xfopen(path, "r");
+
+    if (isbmp(fp))
+        (*(int *)arg)++;
+    xfclose(fp);
+
+    return true;
+}
+
+/* whether rel, a path relative to the directory searched, passes --include
+ * and --exclude. Directories are only pruned by --exclude */
+bool
+isincluded(const char *rel, bool isdir) {
+    bool included = !nincludes || isdir;
+
+    for (size_t i = 0; i < nincludes && !included; i++)
+        included = !fnmatch(includes[i], rel, 0);
+    for (size_t i = 0; i < nexcludes && included; i++)
+        included = fnmatch(excludes[i], rel, 0);
+
+    return included;
+}
+
+/* Calls visit with the path of each regular file of dir, and with --recursive
+ * of its subdirectories, that passes isincluded() and is at least minsize
+ * bytes, until visit returns false. The size and type come from statx(), so
+ * files that can't be what is looked for are never opened. rel is the path
+ * of dir relative to the first one, NULL for the first one itself. Returns
+ * false if visit stopped the walk */
+bool
+walkfiles(const char *dir, const char *rel, off_t minsize, Visitfn visit, void *arg) {
+    struct dirent *d;
+    DIR *dp = xopendir(dir);
+    bool more = true;
+    char path[PATH_MAX], relpath[PATH_MAX];
+
+    while (more && (d = readdir(dp))) {
+        struct statx stx;
+        unsigned int mask = STATX_TYPE | (minsize ? STATX_SIZE : 0);
+        bool isdir = d->d_type == DT_DIR, isreg = d->d_type == DT_REG;
+
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        if (d->d_type == DT_UNKNOWN || (isreg && minsize)) {
+            if (statx(dirfd(dp), d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx))
+                continue;
+            isdir = S_ISDIR(stx.stx_mode);
+            isreg = S_ISREG(stx.stx_mode);
+            if (isreg && minsize && stx.stx_size < (uint64_t)minsize)
+                continue;
+        }
+        if (!isreg && !(isdir && recursive))
+            continue;
+
+        if (rel)
+            xsnprintf(relpath, PATH_MAX, "%s/%.*s", rel, NAME_MAX, d->d_name);
+        else
+            xsnprintf(relpath, PATH_MAX, "%.*s", NAME_MAX, d->d_name);
+        if (!isincluded(relpath, isdir))
+            continue;
+        xsnprintf(path, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
+
+        more = isdir ? walkfiles(path, relpath, minsize, visit, arg) : visit(arg, path);
+    }
+    xclosedir(dp);
+
+    return more;
+}
+
+/* least size of a file that can hide the shadows of a secret of that many
+ * pixels, when shared among k */
+off_t
+minsize(off_t pixels, uint16_t k) {
+    return k ? PIXEL_ARRAY_OFFSET + 8 * blockcount(pixels, k) : 0;
+}
+
+/* whether covers can be looked up in the inotify index, which only knows the
+ * top level of the directories, unfiltered */
+bool
+useindex(void) {
+    return inotifyfd != -1 && !recursive && !nincludes && !nexcludes;
+}
+
 /* Algorithm based on Java's Random, which itself was defined by D. H. Lehmer
  * and described by Knuth in The Art of Computer Programming, Volume 3:
  * Seminumerical Algorithms, section 3.2.1.
  * See: https://docs.oracle.com/javase/8/docs/api/java/util/Random.html#setSeed-long-
  */
 void
-setseed(int64_t s) {
-    rseed = (s ^ 25214903917LL) & 281474976710655LL;
+lcgseed(Lcg *g, int64_t seed) {
+    g->state = (seed ^ LCG_MULTIPLIER) & LCG_MASK;
 }
 
-int
-nextbyte(void) {
-    rseed     = (rseed * 25214903917LL + 11LL) & 281474976710655LL;
-    int64_t n = rseed >> (48 - 31);
+uint8_t
+lcgnext(Lcg *g) {
+    g->state = (g->state * LCG_MULTIPLIER + LCG_INCREMENT) & LCG_MASK;
+
+    return 256ULL * (g->state >> (48 - 31)) >> 31;
+}
+
+/* Moves g steps bytes ahead in O(log steps): x -> ax + c applied n times is
+ * itself affine, and its coefficients are built by repeated squaring. Every
+ * product is taken mod 2^64, and 2^48 divides it */
+void
+lcgjump(Lcg *g, uint64_t steps) {
+    uint64_t mul = 1, add = 0;
+    uint64_t a = LCG_MULTIPLIER, c = LCG_INCREMENT;
+
+    for (; steps; steps >>= 1) {
+        if (steps & 1) {
+            mul = mul * a;
+            add = add * a + c;
+        }
+        c = (a + 1) * c;
+        a = a * a;
+    }
+    g->state = (mul * g->state + add) & LCG_MASK;
+}
+
+void
+lcgworker(void *arg, size_t from, size_t to) {
+    Lcgfill *f = arg;
+    Lcg g      = f->start;
+
+    lcgjump(&g, from);
+    for (size_t i = from; i < to; i++)
+        f->buf[i] = lcgnext(&g);
+}
+
+/* Writes the next len bytes of g to buf. Long runs are split among the
+ * threads, each jumping to the start of its range */
+void
+lcgfill(Lcg *g, uint8_t *buf, size_t len) {
+    if (nthreads > 1 && len >= LCG_PARALLEL_MIN) {
+        Lcgfill f = { .start = *g, .buf = buf };
+
+        parallelfor(len, lcgworker, &f);
+        lcgjump(g, len);
+        return;
+    }
 
-    return 256LL * n >> 31;
+    for (size_t i = 0; i < len; i++)
+        buf[i] = lcgnext(g);
 }
 
 void
 usage(void) {
     die("usage: %s -(d|r) --secret image -k number -w width -h height -s seed"
-            "[-n number] [--dir directory]\n", argv0);
+            "[-n number] [--dir directory] [--keycache directory] [--digest file] [--tile]\n"
+            "           [--name template] [--job id] [--sequence]\n"
+            "       %s --update --secret image -k number -w width -h height "
+            "--digest file [--dir directory]\n"
+            "       %s --reshare -k number -w width -h height --newk number "
+            "--covers directory [-n number] [-s seed] [--dir directory]\n"
+            "       %s --batch file [--keycache directory] [--covercache MiB]\n"
+            "           [--revealcache MiB]\n"
+            "options for all modes: [--threads number] [--pin] [--placement] [--direct]\n"
+            "                       [--prefetch number] [--sync none|batch|fs|file]\n"
+            "                       [--rate KiB/s] [--idle|--no-idle]\n"
+            "                       [--metrics file] [--recursive] [--include glob] [--exclude glob]\n"
+            "batch job options: [--priority number] [--deadline ms] [--memlimit MiB]\n",
+            argv0, argv0, argv0, argv0);
 }
 
 /* Calculates needed pixelarraysize, accounting for padding.
@@ -166,6 +845,100 @@ calculatepixelarraysize(uint32_t width, int32_t height) {
     return ((BITS_PER_PIXEL * width + 31)/32) * 4 * height;
 }
 
+/* bytes shared for a secret of width x height with the depth of the SHADOW_*
+ * flags: its pixel array, packed below 8 bits per pixel */
+uint32_t
+secretsize(uint32_t width, int32_t height, uint16_t flags) {
+    uint32_t depth = SHADOWDEPTH(flags);
+
+    return ((depth * width + 31)/32) * 4 * height;
+}
+
+/* bytes of palette every shadow of a packed secret holds verbatim, ahead of
+ * its shares. Sharing is lossy wherever a block is decreased, which a palette
+ * can't afford, so it isn't shared at all */
+uint32_t
+shadowpalette(uint16_t flags) {
+    uint32_t depth = SHADOWDEPTH(flags);
+
+    return depth == BITS_PER_PIXEL ? 0 : 4 << depth;
+}
+
+/* bytes each of the k shadows of a secret of size bytes hides */
+uint32_t
+shadowsize(uint32_t size, uint16_t k, uint16_t flags) {
+    return shadowpalette(flags) + blockcount(size, k);
+}
+
+/* roughly the bytes shared for the image at path, without reading its
+ * pixels; 0 if it can't be told */
+off_t
+sharedbytes(const char *path) {
+    struct stat st;
+    Bitmap header;
+    FILE *fp;
+
+    if (stat(path, &st) || st.st_size < PIXEL_ARRAY_OFFSET || !(fp = fopen(path, "r")))
+        return 0;
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    fclose(fp);
+
+    /* packed secrets share their palette too */
+    if (header.dibheader.depth == 1 || header.dibheader.depth == 4)
+        return st.st_size - BMP_HEADER_SIZE - DIB_HEADER_SIZE;
+
+    return st.st_size - PIXEL_ARRAY_OFFSET;
+}
+
+/* bytes of palette between the headers and the pixels of bp */
+size_t
+palettesize(const Bitmap *bp) {
+    uint16_t depth = bp->dibheader.depth;
+    uint32_t ncolors = bp->dibheader.ncolors;
+
+    if (depth != 1 && depth != 4)
+        return PALETTE_SIZE;
+
+    return 4 * (ncolors && ncolors < 1u << depth ? ncolors : 1u << depth);
+}
+
+/* Checks that a secret of 1 or 4 bits per pixel can be shared as it is, its
+ * packed pixel array being split into blocks like any other. Its palette goes
+ * to the shadows by formshadows(). Returns the SHADOW_* flag of the depth, or
+ * 0 for 8-bit secrets */
+uint16_t
+packbitmap(const Bitmap *bp) {
+    uint16_t depth = bp->dibheader.depth;
+
+    if (depth != 1 && depth != 4)
+        return 0;
+    if (bp->dibheader.compression)
+        die("can't share compressed bitmaps of %d bits per pixel\n", depth);
+
+    return depth == 1 ? SHADOW_1BIT : SHADOW_4BIT;
+}
+
+/* Gives bp, holding the revealed pixels of a secret, the depth of flags and
+ * the palette kept in its shadows */
+void
+unpackbitmap(Bitmap *bp, uint16_t flags, const uint8_t *palette) {
+    uint16_t depth = SHADOWDEPTH(flags);
+
+    if (depth == BITS_PER_PIXEL)
+        return;
+
+    uint32_t size = bmpimagesize(bp);
+
+    memset(bp->palette, 0, sizeof(bp->palette));
+    memcpy(bp->palette, palette, shadowpalette(flags));
+    bp->dibheader.depth          = depth;
+    bp->dibheader.ncolors        = 0;
+    bp->dibheader.pixelarraysize = size;
+    bp->bmpheader.offset         = BMP_HEADER_SIZE + DIB_HEADER_SIZE + shadowpalette(flags);
+    bp->bmpheader.size           = bp->bmpheader.offset + size;
+}
+
 uint32_t
 get32bitsfromheader(FILE *fp, int offset) {
     uint32_t value;
@@ -201,19 +974,14 @@ initpalette(uint8_t palette[static PALETTE_SIZE]) {
     }
 }
 
-/* If no seed is needed, just pass 0 */
-Bitmap *
-newbitmap(uint32_t width, int32_t height, uint16_t seed) {
-    uint32_t pixelarraysize = calculatepixelarraysize(width, height);
-    return newbitmaphelper(width, height, seed, 0, pixelarraysize);
-}
-
-/* Helper function to build a BMP, used by newbitmap() and newshadow() */
+/* Helper function to build a BMP, used by newshadow() and to hold revealed
+ * secrets */
 Bitmap*
 newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum, uint32_t pixelarraysize) {
     Bitmap *bmp = xmalloc(sizeof(*bmp));
 
     bmp->imgpixels = xmalloc(pixelarraysize);
+    bmp->preamble  = NULL;
     initpalette(bmp->palette);
 
     bmp->bmpheader = (BMPheader)
@@ -246,6 +1014,7 @@ newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum,
 void
 freebitmap(Bitmap *bp) {
     free(bp->imgpixels);
+    free(bp->preamble);
     free(bp);
 }
 
@@ -340,449 +1109,2828 @@ writedibheader(const Bitmap *bp, FILE *fp) {
     xfwrite(&(h.nimpcolors), sizeof(h.nimpcolors), 1, fp);
 }
 
+/* Reads the whole of filename with O_DIRECT into an aligned buffer. Returns
+ * NULL when the file system doesn't take O_DIRECT, for the caller to fall
+ * back to buffered reads */
+uint8_t *
+readdirect(const char *filename, size_t *size) {
+    struct stat st;
+    void *buf;
+    int fd = open(filename, O_RDONLY | O_DIRECT);
+
+    if (fd == -1) {
+        if (errno != EINVAL)
+            die("open: couldn't open %s\n", filename);
+        return NULL;
+    }
+    if (fstat(fd, &st))
+        die("fstat: couldn't stat %s\n", filename);
+    *size = st.st_size;
+    if (posix_memalign(&buf, DIRECT_ALIGN, (*size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN + DIRECT_ALIGN))
+        die("posix_memalign: couldn't allocate %zu bytes\n", *size);
+
+    for (size_t off = 0; off < *size;) {
+        size_t len = *size - off < DIRECT_CHUNK ? *size - off : DIRECT_CHUNK;
+        ssize_t r  = pread(fd, (uint8_t *)buf + off, (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN, off);
+
+        if (r == -1 && errno == EINVAL && off == 0) {
+            free(buf);
+            xclose(fd);
+            return NULL;
+        }
+        if (r <= 0)
+            die("pread: error reading %s\n", filename);
+        off += r;
+    }
+    xclose(fd);
+
+    return buf;
+}
+
 Bitmap *
 bmpfromfile(const char *filename) {
-    FILE *fp = xfopen(filename, "r");
-    Bitmap *bp = xmalloc(sizeof(*bp));
+    uint8_t *direct = NULL;
+    size_t size;
+    FILE *fp;
+    Bitmap *bp;
+
+    if (directio && (direct = readdirect(filename, &size))) {
+        if (!(fp = fmemopen(direct, size, "r")))
+            die("fmemopen: error\n");
+    } else {
+        fp = xfopen(filename, "r");
+    }
+
+    if (!(bp = bmpfromfp(fp)))
+        die("%s: empty file\n", filename);
+    xfclose(fp);
+    free(direct);
 
-    readbmpheader(bp, fp);
-    readdibheader(bp, fp);
-    xfread(bp->palette, sizeof(bp->palette), 1, fp);
+    return bp;
+}
+
+/* Reads the bitmap at the current position of fp, so a sequence container
+ * can be read a frame at a time. NULL if fp is at its end */
+Bitmap *
+bmpfromfp(FILE *fp) {
+    Bitmap *bp;
+    double start = monotonic();
+    int c        = getc(fp);
+
+    if (c == EOF)
+        return NULL;
+    ungetc(c, fp);
+
+    /* everything up to the pixels is kept as is, and parsed from memory, so
+     * any header version and palette length pass through to the stego images */
+    uint8_t head[BMP_HEADER_SIZE];
+    xfread(head, sizeof(head), 1, fp);
+    uint32_t offset = getle(head + 10, 4);
+    if (offset < BMP_HEADER_SIZE + DIB_HEADER_SIZE)
+        die("bitmap with its pixels at %u, inside its headers\n", offset);
+
+    bp = xmalloc(sizeof(*bp));
+    bp->preamble = xmalloc(offset);
+    memcpy(bp->preamble, head, sizeof(head));
+    xfread(bp->preamble + BMP_HEADER_SIZE, offset - BMP_HEADER_SIZE, 1, fp);
+
+    FILE *pf = fmemopen(bp->preamble, offset, "r");
+    if (!pf)
+        die("fmemopen: error\n");
+    readbmpheader(bp, pf);
+    readdibheader(bp, pf);
+    size_t palette = palettesize(bp);
+    size_t dibend  = BMP_HEADER_SIZE + (size_t)bp->dibheader.size;
+    if (dibend > offset)
+        die("bitmap with a DIB header of %u bytes before pixels at %u\n", bp->dibheader.size, offset);
+    if (palette > offset - dibend)
+        palette = offset - dibend;
+    memset(bp->palette, 0, sizeof(bp->palette));
+    memcpy(bp->palette, bp->preamble + dibend, palette);
+    xfclose(pf);
 
-    /* read pixel data */
+    /* read pixel data; big arrays by several threads, straight from the fd */
     uint32_t imagesize = bmpimagesize(bp);
+    off_t pos;
+    throttle(bp->bmpheader.offset + imagesize);
     bp->imgpixels = xmalloc(imagesize);
-    xfread(bp->imgpixels, sizeof(bp->imgpixels[0]), imagesize, fp);
-    xfclose(fp);
+    if (nthreads > 1 && imagesize >= PARALLEL_IO_MIN && fileno(fp) != -1
+            && (pos = ftello(fp)) != -1) {
+        if (!parallelio(fileno(fp), bp->imgpixels, imagesize, pos, false))
+            die("pread: error reading a bitmap\n");
+        xfseek(fp, pos + imagesize, SEEK_SET);
+    } else {
+        xfread(bp->imgpixels, sizeof(bp->imgpixels[0]), imagesize, fp);
+    }
+    stats.bytesread += bp->bmpheader.offset + imagesize;
+    stats.stage[STAGE_READ] += monotonic() - start;
 
     return bp;
 }
 
-bool
-isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint32_t shadowsize = (secretsize * 8)/k;
-    uint32_t imgsize    = bmpfilewidth(fp) * bmpfileheight(fp);
+/* Opens filename for writing; with --direct, through O_DIRECT when the file
+ * system takes it, and through stdio otherwise */
+Output *
+outopen(const char *filename) {
+    Output *out = xmalloc(sizeof(*out));
+    int direct  = directio ? O_DIRECT : 0;
+    char dir[PATH_MAX];
 
-    return imgsize >= shadowsize;
+    /* the file only gets its name once complete, so concurrent readers and
+     * crashes never see part of it: it is made as an O_TMPFILE in the right
+     * directory and linked by outclose(), or where that isn't supported,
+     * under a name unique to this process and renamed over filename */
+    *out = (Output) { .path = filename };
+    pathdir(filename, dir);
+    out->fd = createfile(dir, O_WRONLY | O_TMPFILE | direct);
+    if (out->fd == -1) {
+        out->tmppath = tmpname(filename);
+        out->fd      = createfile(out->tmppath, O_WRONLY | O_CREAT | O_TRUNC | direct);
+        if (out->fd == -1)
+            die("open: couldn't open %s\n", out->tmppath);
+    }
+    if (!(fcntl(out->fd, F_GETFL) & O_DIRECT)) {
+        if (!(out->fp = fdopen(out->fd, "w")))
+            die("fdopen: couldn't open %s\n", filename);
+        return out;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        void *chunk;
+
+        if (posix_memalign(&chunk, DIRECT_ALIGN, DIRECT_CHUNK))
+            die("posix_memalign: couldn't allocate %d bytes\n", DIRECT_CHUNK);
+        out->chunk[i] = chunk;
+    }
+
+    return out;
 }
 
-bool
-kdivisiblesize(FILE *fp, uint16_t k) {
-    int pixels = bmpfilewidth(fp) * bmpfileheight(fp);
-    int aux    = pixels / k;
+/* open() with flags, without O_DIRECT if the file system refuses it */
+int
+createfile(const char *path, int flags) {
+    int fd = open(path, flags, 0644);
 
-    return pixels == aux * k;
+    if (fd == -1 && (flags & O_DIRECT) && errno == EINVAL)
+        fd = open(path, flags & ~O_DIRECT, 0644);
+
+    return fd;
 }
 
-uint32_t
-bmpimagesize(const Bitmap *bp) {
-    uint32_t sz = bp->bmpheader.size;
+/* name for path while it is being written, unique to this process */
+char *
+tmpname(const char *path) {
+    char *tmp = xmalloc(PATH_MAX);
 
-    if (sz > 0)
-        return bp->bmpheader.size - bp->bmpheader.offset;
+    xsnprintf(tmp, PATH_MAX, "%s.%ld.tmp", path, (long)getpid());
 
-    return bp->dibheader.pixelarraysize;
+    return tmp;
 }
 
+/* waits for the write of chunk i, if any. A file system that only refuses
+ * O_DIRECT once writing is switched to plain writes, and the chunk rewritten */
 void
-bmptofile(const Bitmap *bp, const char *filename) {
-    FILE *fp = xfopen(filename, "w");
+outwait(Output *out, size_t i) {
+    const struct aiocb *list[1] = { &out->cb[i] };
+    int err;
 
-    writebmpheader(bp, fp);
-    writedibheader(bp, fp);
-    xfwrite(bp->palette, PALETTE_SIZE, 1, fp);
-    xfwrite(bp->imgpixels, bmpimagesize(bp), 1, fp);
-    xfclose(fp);
+    if (!out->pending[i])
+        return;
+    while ((err = aio_error(&out->cb[i])) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+    out->pending[i] = false;
+
+    /* a failed request tells its error through aio_error(), not errno */
+    ssize_t r = aio_return(&out->cb[i]);
+    if (r == -1 && err == EINVAL) {
+        fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+        r = pwrite(out->fd, (void *)out->cb[i].aio_buf, out->cb[i].aio_nbytes, out->cb[i].aio_offset);
+    }
+    if (r != (ssize_t)out->cb[i].aio_nbytes)
+        die("aio_write: error writing %s\n", out->path);
 }
 
-/* find closest pair of values that when multiplied, give x.
- * Used to make the shadows as 'squared' as possible */
+/* queues the current chunk, padded to DIRECT_ALIGN, and moves to the other */
 void
-findclosestpair(uint32_t x, uint32_t *width, int32_t *height) {
-    unsigned int y = floor(sqrt(x));
+outsubmit(Output *out) {
+    struct aiocb *cb = &out->cb[out->cur];
+    size_t len = (out->fill + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
 
-    for (; y > 2; y--)
-        if (x % y == 0) {
-            *width  = y;
-            *height = x / y;
-            break;
-        }
-}
+    memset(out->chunk[out->cur] + out->fill, 0, len - out->fill);
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = out->fd;
+    cb->aio_buf    = out->chunk[out->cur];
+    cb->aio_nbytes = len;
+    cb->aio_offset = out->off;
+    if (aio_write(cb))
+        die("aio_write: couldn't queue a write to %s\n", out->path);
+    out->pending[out->cur] = true;
 
-Bitmap *
-newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber) {
-    return newbitmaphelper(width, height, seed, shadownumber, width * height);
+    out->off += out->fill;
+    out->fill = 0;
+    out->cur ^= 1;
+    outwait(out, out->cur);
 }
 
-Bitmap **
-formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed) {
-    uint32_t width;
-    int32_t height;
-    uint32_t pixelarraysize = bmpimagesize(bp);
-    Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
-    uint16_t *pixels = xmalloc(sizeof(*pixels) * n);
+void
+outwrite(Output *out, const void *buf, size_t len) {
+    const uint8_t *p = buf;
 
-    findclosestpair(pixelarraysize/k, &width, &height);
+    throttle(len);
+    double start = monotonic();
+    if (out->fp)
+        xfwrite(buf, len, 1, out->fp);
+    while (!out->fp && len) {
+        size_t n = DIRECT_CHUNK - out->fill < len ? DIRECT_CHUNK - out->fill : len;
 
-    /* allocate shadows */
-    for (size_t i = 0; i < n; i++)
-        shadows[i] = newshadow(width, height, seed, i+1);
+        memcpy(out->chunk[out->cur] + out->fill, p, n);
+        out->fill += n;
+        p   += n;
+        len -= n;
+        if (out->fill == DIRECT_CHUNK)
+            outsubmit(out);
+    }
+    stats.stage[STAGE_WRITE] += monotonic() - start;
+}
 
-    /* generate shadow image pixels */
-    for (size_t j = 0; j*k < pixelarraysize; j++) {
-        uint8_t *coeff = &bp->imgpixels[j*k];
+/* whether the len pixel bytes about to be written to out are worth
+ * outwriteat() from several threads: out must be buffered and still empty */
+bool
+outparallel(const Output *out, size_t len) {
+    return out->fp && nthreads > 1 && len >= PARALLEL_IO_MIN && ftello(out->fp) == 0;
+}
 
-        /* Paper's 4th step, mixed with the 3rd one */
-        step4:
-        for (size_t i = 0; i < n; i++) {
-            /* uses coeff[0] to coeff[k-1] (where k-1 is the degree of the
-             * polynomial) to evaluate the corresponding section polynomial and
-             * generate a pixel for the i-th shadow image */
-            uint64_t value = 0;
+/* Writes len bytes at offset off of out, bypassing its stdio buffer. Once
+ * the preamble is written, out has to be moved to its end with xfseek() */
+void
+outwriteat(Output *out, const void *buf, size_t len, off_t off) {
+    throttle(len);
+    double start = monotonic();
+    if (!parallelio(out->fd, (uint8_t *)buf, len, off, true))
+        die("pwrite: error writing %s\n", out->path);
+    stats.stage[STAGE_WRITE] += monotonic() - start;
+}
 
-            for (size_t r = 0; r < k; r++)
-                value += coeff[r] * pow(i+1, r);
+void *
+ioworker(void *arg) {
+    Iojob *j = arg;
 
-            pixels[i] = value % PRIME;
-        }
+    for (size_t c = j->first * PARALLEL_IO_CHUNK; c < j->len; c += j->stride * PARALLEL_IO_CHUNK) {
+        size_t len = j->len - c < PARALLEL_IO_CHUNK ? j->len - c : PARALLEL_IO_CHUNK;
 
-        for (size_t i = 0; i < n; i++) {
-            if (pixels[i] == 256) {
-                decreasecoeff(coeff);
-                goto step4;
+        for (size_t done = 0; done < len;) {
+            ssize_t r = j->write ? pwrite(j->fd, j->buf + c + done, len - done, j->off + c + done)
+                                 : pread(j->fd, j->buf + c + done, len - done, j->off + c + done);
+            if (r <= 0) {
+                j->failed = true;
+                return NULL;
             }
+            done += r;
         }
-
-        for (size_t i = 0; i < n; i++)
-            shadows[i]->imgpixels[j] = pixels[i];
     }
-    free(pixels);
 
-    return shadows;
+    return NULL;
 }
 
-/* decrease the first non-zero coefficient by one */
-inline void
-decreasecoeff(uint8_t *coeff) {
-    int i = 0;
+/* Moves len bytes between buf and the file of fd from offset off, with
+ * pread() or pwrite() of PARALLEL_IO_CHUNK bytes issued by up to nthreads
+ * threads, each taking every nthreads-th chunk. A single huge file then keeps
+ * as many requests in flight as there are threads, which striped storage
+ * needs to reach its bandwidth. false if any of them failed */
+bool
+parallelio(int fd, uint8_t *buf, size_t len, off_t off, bool write) {
+    pthread_t tids[MAX_THREADS];
+    Iojob jobs[MAX_THREADS];
+    size_t chunks = (len + PARALLEL_IO_CHUNK - 1) / PARALLEL_IO_CHUNK;
+    size_t count  = nthreads < chunks ? nthreads : chunks;
+    bool ok       = true;
 
-    /* We can assume some value is 0, as it is proved in the paper */
-    while (coeff[i] == 0)
-        i++;
+    for (size_t t = 0; t < count; t++) {
+        jobs[t] = (Iojob)
+            { .fd     = fd
+            , .buf    = buf
+            , .len    = len
+            , .off    = off
+            , .write  = write
+            , .first  = t
+            , .stride = count
+            };
+        if (pthread_create(&tids[t], NULL, ioworker, &jobs[t]))
+            die("pthread_create: couldn't start thread %zu\n", t);
+    }
+    for (size_t t = 0; t < count; t++) {
+        pthread_join(tids[t], NULL);
+        ok = ok && !jobs[t].failed;
+    }
 
-    coeff[i]--;
+    return ok;
 }
 
+/* Writes the headers and palette of bp. Those read from a file are written
+ * back byte for byte, except for the key and shadow number fields */
 void
-findcoefficients(int **mat, uint16_t k) {
-    int i, j, t, a, temp;
+outwritepreamble(Output *out, const Bitmap *bp) {
+    char *buf;
+    size_t len;
 
-    /* take matrix to echelon form */
-    for (size_t j = 0; j < k-1; j++) {
-        for (size_t i = k-1; i > j; i--) {
-            int a = mat[i][j] * modinv[mat[i-1][j]];
-            for (size_t t = j; t < k+1; t++) {
-                int temp = mat[i][t] - ((mat[i-1][t] * a) % PRIME);
-                mat[i][t] = mod(temp, PRIME);
-            }
-        }
-    }
+    if (bp->preamble) {
+        uint8_t fields[4];
 
-    /* take matrix to reduced row echelon form */
-    for (size_t i = k-1; i > 0; i--) {
-        mat[i][k] = (mat[i][k] * modinv[mat[i][i]]) % PRIME;
-        mat[i][i] = (mat[i][i] * modinv[mat[i][i]]) % PRIME;
-        for (int t = i-1; t >= 0; t--) {
-            int temp = mat[t][k] - ((mat[i][k] * mat[t][i]) % PRIME);
-            mat[t][k] = mod(temp, PRIME);
-            mat[t][i] = 0;
-        }
+        putle(fields, bp->bmpheader.unused1, 2);
+        putle(fields + 2, bp->bmpheader.unused2, 2);
+        outwrite(out, bp->preamble, UNUSED1_OFFSET);
+        outwrite(out, fields, sizeof(fields));
+        outwrite(out, bp->preamble + UNUSED1_OFFSET + sizeof(fields),
+                bp->bmpheader.offset - UNUSED1_OFFSET - sizeof(fields));
+        return;
+    }
+    if (out->fp) {
+        double start = monotonic();
+        writebmpheader(bp, out->fp);
+        writedibheader(bp, out->fp);
+        xfwrite(bp->palette, palettesize(bp), 1, out->fp);
+        stats.stage[STAGE_WRITE] += monotonic() - start;
+        return;
     }
+
+    FILE *fp = open_memstream(&buf, &len);
+    if (!fp)
+        die("open_memstream: error\n");
+    writebmpheader(bp, fp);
+    writedibheader(bp, fp);
+    xfwrite(bp->palette, palettesize(bp), 1, fp);
+    xfclose(fp);
+    outwrite(out, buf, len);
+    free(buf);
+}
+
+/* bytes outwritepreamble() writes for bp */
+size_t
+preamblesize(const Bitmap *bp) {
+    if (bp->preamble)
+        return bp->bmpheader.offset;
+
+    return BMP_HEADER_SIZE + DIB_HEADER_SIZE + palettesize(bp);
+}
+
+/* Flushes and closes out. The padding of the last chunk is cut off. Then the
+ * file is made durable as --sync says */
+void
+outclose(Output *out) {
+    double start = monotonic();
+
+    if (out->fp) {
+        if (fflush(out->fp))
+            die("fflush: error writing %s\n", out->path);
+        stats.byteswritten += ftell(out->fp);
+    } else {
+        off_t size = out->off + out->fill;
+
+        stats.byteswritten += size;
+
+        if (out->fill)
+            outsubmit(out);
+        outwait(out, 0);
+        outwait(out, 1);
+        if (ftruncate(out->fd, size))
+            die("ftruncate: couldn't truncate %s\n", out->path);
+        free(out->chunk[0]);
+        free(out->chunk[1]);
+    }
+
+    if (syncmode == SYNC_FILE && fsync(out->fd))
+        die("fsync: couldn't sync %s\n", out->path);
+
+    /* an O_TMPFILE can't be linked over an existing file, so in that case
+     * it is linked under a temporary name to be renamed like the fallback */
+    if (!out->tmppath) {
+        char proc[32];
+
+        xsnprintf(proc, sizeof(proc), "/proc/self/fd/%d", out->fd);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, out->path, AT_SYMLINK_FOLLOW)) {
+            out->tmppath = tmpname(out->path);
+            if (errno != EEXIST
+                    || linkat(AT_FDCWD, proc, AT_FDCWD, out->tmppath, AT_SYMLINK_FOLLOW))
+                die("linkat: couldn't create %s\n", out->path);
+        }
+    }
+    if (out->tmppath) {
+        if (rename(out->tmppath, out->path))
+            die("rename: couldn't rename %s to %s\n", out->tmppath, out->path);
+        free(out->tmppath);
+    }
+
+    if (syncmode == SYNC_FILE)
+        syncdir(out->path);
+    else if (syncmode != SYNC_NONE)
+        leaveunsynced(out->path);
+
+    if (out->fp)
+        xfclose(out->fp);
+    else
+        xclose(out->fd);
+    stats.stage[STAGE_WRITE] += monotonic() - start;
+    free(out);
+}
+
+/* writes to dir the directory holding path, of at least PATH_MAX bytes */
+void
+pathdir(const char *path, char *dir) {
+    const char *slash = strrchr(path, '/');
+
+    if (slash == path)
+        xsnprintf(dir, PATH_MAX, "/");
+    else if (slash)
+        xsnprintf(dir, PATH_MAX, "%.*s", (int)(slash - path), path);
+    else
+        xsnprintf(dir, PATH_MAX, ".");
+}
+
+/* fsyncs the directory holding path, so that its entry is durable too */
+void
+syncdir(const char *path) {
+    char dir[PATH_MAX];
+
+    pathdir(path, dir);
+    int fd = xopen(dir, O_RDONLY | O_DIRECTORY, 0);
+    if (fsync(fd))
+        die("fsync: couldn't sync %s\n", dir);
+    xclose(fd);
+}
+
+/* xfclose() for a file modified in place: with --sync file it is synced right
+ * away, otherwise it is left for syncoutputs() like any other output */
+void
+syncclose(FILE *fp, const char *path) {
+    double start = monotonic();
+
+    if (syncmode == SYNC_FILE) {
+        if (fflush(fp) || fsync(fileno(fp)))
+            die("fsync: couldn't sync %s\n", path);
+    } else if (syncmode != SYNC_NONE) {
+        leaveunsynced(path);
+    }
+    xfclose(fp);
+    stats.stage[STAGE_WRITE] += monotonic() - start;
+}
+
+/* records path for syncoutputs() */
+void
+leaveunsynced(const char *path) {
+    unsynced = realloc(unsynced, sizeof(*unsynced) * (nunsynced + 1));
+    if (!unsynced)
+        die("realloc: out of memory\n");
+    unsynced[nunsynced++] = xstrdup(path);
+}
+
+/* Makes the outputs of a job durable at once, after all of them have been
+ * written, so their writeback overlaps: --sync batch fsyncs each of them and
+ * their directories, --sync fs issues a single syncfs() per file system */
+void
+syncoutputs(void) {
+    dev_t *synced  = xmalloc(sizeof(*synced) * (nunsynced + 1));
+    size_t nsynced = 0;
+    double start   = monotonic();
+
+    for (size_t i = 0; i < nunsynced; i++) {
+        struct stat st;
+        int fd = xopen(unsynced[i], O_RDONLY, 0);
+
+        if (fstat(fd, &st))
+            die("fstat: couldn't stat %s\n", unsynced[i]);
+        if (syncmode == SYNC_BATCH) {
+            if (fsync(fd))
+                die("fsync: couldn't sync %s\n", unsynced[i]);
+            syncdir(unsynced[i]);
+        } else {
+            size_t j = 0;
+            while (j < nsynced && synced[j] != st.st_dev)
+                j++;
+            if (j == nsynced) {
+                if (syncfs(fd))
+                    die("syncfs: couldn't sync %s\n", unsynced[i]);
+                synced[nsynced++] = st.st_dev;
+            }
+        }
+        xclose(fd);
+        free(unsynced[i]);
+    }
+    free(synced);
+    free(unsynced);
+    unsynced  = NULL;
+    nunsynced = 0;
+    stats.stage[STAGE_WRITE] += monotonic() - start;
+}
+
+bool
+isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize) {
+    uint32_t shadowsize = 8 * blockcount(secretsize, k);
+    uint32_t imgsize    = bmpfilewidth(fp) * bmpfileheight(fp);
+
+    return imgsize >= shadowsize;
+}
+
+bool
+kdivisiblesize(FILE *fp, uint16_t k) {
+    int pixels = bmpfilewidth(fp) * bmpfileheight(fp);
+    int aux    = pixels / k;
+
+    return pixels == aux * k;
+}
+
+uint32_t
+bmpimagesize(const Bitmap *bp) {
+    uint32_t sz = bp->bmpheader.size;
+
+    if (sz > 0)
+        return bp->bmpheader.size - bp->bmpheader.offset;
+
+    return bp->dibheader.pixelarraysize;
+}
+
+void
+bmptofile(const Bitmap *bp, const char *filename) {
+    Output *out   = outopen(filename);
+    uint32_t size = bmpimagesize(bp);
+
+    /* big pixel arrays go first, from several threads, and the header last */
+    if (outparallel(out, size)) {
+        outwriteat(out, bp->imgpixels, size, preamblesize(bp));
+        outwritepreamble(out, bp);
+        xfseek(out->fp, 0, SEEK_END);
+    } else {
+        outwritepreamble(out, bp);
+        outwrite(out, bp->imgpixels, size);
+    }
+    outclose(out);
+}
+
+/* Reorders the pixels of bp so that each TILE_SIDE x TILE_SIDE tile of the
+ * image is contiguous, tiles following each other in row order, and edge
+ * tiles being narrower or shorter. Each block then covers a compact region of
+ * the image, and each band of TILE_SIDE rows a contiguous range of every
+ * shadow. With untile, the tiled order is taken back to rows */
+void
+tilebitmap(Bitmap *bp, bool untile) {
+    uint32_t stride = calculatepixelarraysize(bp->dibheader.width, 1);
+    uint32_t rows   = bp->dibheader.height < 0 ? -bp->dibheader.height : bp->dibheader.height;
+    uint32_t size   = bmpimagesize(bp);
+    uint8_t *pixels = xmalloc(size);
+    size_t p        = 0;
+
+    if ((uint64_t)stride * rows != size)
+        die("can't tile a pixel array of %u bytes as %u rows of %u\n", size, rows, stride);
+
+    for (uint32_t ty = 0; ty < rows; ty += TILE_SIDE) {
+        uint32_t ymax = rows - ty < TILE_SIDE ? rows : ty + TILE_SIDE;
+        for (uint32_t tx = 0; tx < stride; tx += TILE_SIDE) {
+            uint32_t xmax = stride - tx < TILE_SIDE ? stride : tx + TILE_SIDE;
+            for (uint32_t y = ty; y < ymax; y++) {
+                uint32_t w = xmax - tx;
+                if (untile)
+                    memcpy(&pixels[y*stride + tx], &bp->imgpixels[p], w);
+                else
+                    memcpy(&pixels[p], &bp->imgpixels[y*stride + tx], w);
+                p += w;
+            }
+        }
+    }
+
+    free(bp->imgpixels);
+    bp->imgpixels = pixels;
+}
+
+/* find closest pair of values that when multiplied, give x.
+ * Used to make the shadows as 'squared' as possible */
+void
+findclosestpair(uint32_t x, uint32_t *width, int32_t *height) {
+    unsigned int y = floor(sqrt(x));
+
+    *width  = x;
+    *height = 1;
+
+    for (; y > 2; y--)
+        if (x % y == 0) {
+            *width  = y;
+            *height = x / y;
+            break;
+        }
 }
 
 Bitmap *
-revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k) {
-    uint32_t pixels = (*shadows)->dibheader.pixelarraysize;
-    Bitmap *bmp = newbitmap(width, height, (*shadows)->bmpheader.unused1);
+newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber) {
+    return newbitmaphelper(width, height, seed, shadownumber, width * height);
+}
 
-    int **mat = xmalloc(sizeof(*mat) * k);
-    for (size_t i = 0; i < k; i++)
-        mat[i] = xmalloc(sizeof(**mat) * (k+1));
-
-    for (size_t i = 0; i < pixels; i++) {
-        for (size_t j = 0; j < k; j++) {
-            Bitmap *sp = shadows[j];
-            int value = sp->bmpheader.unused2;
-            mat[j][0] = 1;
-            for (size_t t = 1; t < k; t++) {
-                mat[j][t] = value;
-                value *= sp->bmpheader.unused2;
+/* Computes in pixels the n shadow pixels of the block of k coefficients at
+ * coeff. The coefficients are decreased until no pixel is 256 */
+void
+shareblock(uint8_t *coeff, uint16_t k, uint16_t n, uint16_t *pixels) {
+    /* Paper's 4th step, mixed with the 3rd one */
+    step4:
+    for (size_t i = 0; i < n; i++) {
+        /* uses coeff[0] to coeff[k-1] (where k-1 is the degree of the
+         * polynomial) to evaluate the corresponding section polynomial with
+         * Horner's rule and generate a pixel for the i-th shadow image */
+        uint32_t x     = (i+1) % PRIME;
+        uint32_t value = coeff[k-1];
+
+        for (size_t r = k-1; r-- > 0;)
+            value = (value * x + coeff[r]) % PRIME;
+
+        pixels[i] = value;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (pixels[i] == 256) {
+            decreasecoeff(coeff);
+            goto step4;
+        }
+    }
+}
+
+/* Shares nblocks consecutive blocks of k coefficients starting at coeff, the
+ * pixels of block j going to out[i][outoff + j] for the i-th shadow. The
+ * polynomials of KERNEL_LANES blocks are evaluated side by side, so that the
+ * inner loops run across blocks and vectorize no matter how small k and n
+ * are. The few blocks with a pixel of 256 are then redone by shareblock() */
+void
+sharekernel(uint8_t *coeff, size_t nblocks, uint16_t k, uint16_t n, uint8_t **out, size_t outoff) {
+    uint16_t *lanes  = xmalloc(sizeof(*lanes) * k * KERNEL_LANES);
+    uint16_t *pixels = xmalloc(sizeof(*pixels) * n);
+    uint32_t acc[KERNEL_LANES];
+    bool overflow[KERNEL_LANES];
+
+    for (size_t base = 0; base < nblocks; base += KERNEL_LANES) {
+        size_t nlanes = nblocks - base < KERNEL_LANES ? nblocks - base : KERNEL_LANES;
+
+        /* transpose, so that lanes[r * KERNEL_LANES + b] is coeff r of block b */
+        for (size_t b = 0; b < nlanes; b++)
+            for (size_t r = 0; r < k; r++)
+                lanes[r * KERNEL_LANES + b] = coeff[(base + b) * k + r];
+        memset(overflow, 0, sizeof(overflow));
+
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = (i+1) % PRIME;
+            uint8_t *o = out[i] + outoff + base;
+
+            for (size_t b = 0; b < nlanes; b++)
+                acc[b] = lanes[(k-1) * KERNEL_LANES + b];
+            for (size_t r = k-1; r-- > 0;) {
+                const uint16_t *c = &lanes[r * KERNEL_LANES];
+                for (size_t b = 0; b < nlanes; b++)
+                    acc[b] = (acc[b] * x + c[b]) % PRIME;
+            }
+            for (size_t b = 0; b < nlanes; b++) {
+                overflow[b] |= acc[b] == 256;
+                o[b] = acc[b];
             }
-            mat[j][k] = sp->imgpixels[i];
         }
-        findcoefficients(mat, k);
-        for (size_t j = i * k; j < (i+1) * k; j++) {
-            bmp->imgpixels[j] = mat[j % k][k];
+
+        for (size_t b = 0; b < nlanes; b++) {
+            if (!overflow[b])
+                continue;
+            shareblock(&coeff[(base + b) * k], k, n, pixels);
+            for (size_t i = 0; i < n; i++)
+                out[i][outoff + base + b] = pixels[i];
+        }
+    }
+    free(lanes);
+    free(pixels);
+}
+
+void
+shareworker(void *arg, size_t from, size_t to) {
+    Sharejob *job = arg;
+
+    sharekernel(job->coeff + from * job->k, to - from, job->k, job->n, job->out, job->outoff + from);
+}
+
+/* sharekernel() over nthreads threads */
+void
+shareblocks(uint8_t *coeff, size_t nblocks, uint16_t k, uint16_t n, uint8_t **out, size_t outoff) {
+    Sharejob job = { .coeff = coeff, .k = k, .n = n, .out = out, .outoff = outoff };
+    double start = monotonic();
+
+    parallelfor(nblocks, shareworker, &job);
+    stats.stage[STAGE_KERNEL] += monotonic() - start;
+}
+
+/* blocks a secret of size bytes is split into, the last one padded with zeros
+ * if size isn't a multiple of k */
+size_t
+blockcount(size_t size, uint16_t k) {
+    return (size + k - 1) / k;
+}
+
+/* shareblocks() over the size bytes at secret, a last partial block being
+ * shared from a copy padded with zeros */
+void
+sharebytes(uint8_t *secret, size_t size, uint16_t k, uint16_t n, uint8_t **out, size_t outoff) {
+    size_t full = size / k;
+
+    shareblocks(secret, full, k, n, out, outoff);
+    if (size % k) {
+        uint8_t *last = xmalloc(k);
+
+        memset(last, 0, k);
+        memcpy(last, secret + full * k, size % k);
+        shareblocks(last, 1, k, n, out, outoff + full);
+        free(last);
+    }
+}
+
+/* flags are the SHADOW_* ones of the depth of bp, whose palette, if packed,
+ * is copied ahead of the shares of every shadow */
+Bitmap **
+formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed, uint16_t flags) {
+    uint32_t width;
+    int32_t height;
+    uint32_t pixelarraysize = bmpimagesize(bp);
+    uint32_t palette = shadowpalette(flags);
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
+    uint8_t **out    = xmalloc(sizeof(*out) * n);
+
+    findclosestpair(shadowsize(pixelarraysize, k, flags), &width, &height);
+
+    /* allocate shadows */
+    for (size_t i = 0; i < n; i++) {
+        shadows[i] = newshadow(width, height, seed, (i+1) | flags);
+        out[i]     = shadows[i]->imgpixels;
+        memcpy(out[i], bp->palette, palette);
+    }
+
+    /* generate shadow image pixels */
+    sharebytes(bp->imgpixels, pixelarraysize, k, n, out, palette);
+    free(out);
+
+    return shadows;
+}
+
+/* decrease the first non-zero coefficient by one */
+inline void
+decreasecoeff(uint8_t *coeff) {
+    int i = 0;
+
+    /* We can assume some value is 0, as it is proved in the paper */
+    while (coeff[i] == 0)
+        i++;
+
+    coeff[i]--;
+}
+
+/* Inverts modulo PRIME the Vandermonde matrix of the shadow numbers, so
+ * that inv[r * k + j] is the weight of the pixel of the j-th shadow in the
+ * r-th coefficient of every block. The matrix is the same for all blocks, so
+ * revealing one is just a product instead of solving the whole system */
+int *
+invertvandermonde(Bitmap **shadows, uint16_t k) {
+    int *mat = xmalloc(sizeof(*mat) * k * 2 * k);
+    int *inv = xmalloc(sizeof(*inv) * k * k);
+    size_t w = 2 * k;
+
+    /* [ V | I ], with V[j][r] = x_j^r */
+    for (size_t j = 0; j < k; j++) {
+        int x = SHADOWNUM(shadows[j]->bmpheader.unused2) % PRIME;
+        int value = 1;
+        for (size_t r = 0; r < k; r++) {
+            mat[j*w + r]     = value;
+            mat[j*w + k + r] = j == r;
+            value = value * x % PRIME;
         }
     }
 
-    xorbmpwithrandomtable(bmp, (*shadows)->bmpheader.unused1);
+    for (size_t c = 0; c < k; c++) {
+        size_t p = c;
+        while (p < k && mat[p*w + c] == 0)
+            p++;
+        if (p == k)
+            die("shadows with repeated numbers (mod %d) can't reveal a secret\n", PRIME);
+        for (size_t t = 0; t < w; t++) {
+            int tmp = mat[c*w + t];
+            mat[c*w + t] = mat[p*w + t];
+            mat[p*w + t] = tmp;
+        }
 
-    for (size_t i = 0; i < k; i++)
-        free(mat[i]);
+        int a = modinv[mat[c*w + c]];
+        for (size_t t = 0; t < w; t++)
+            mat[c*w + t] = mat[c*w + t] * a % PRIME;
+        for (size_t i = 0; i < k; i++) {
+            int f = mat[i*w + c];
+            if (i == c || f == 0)
+                continue;
+            for (size_t t = 0; t < w; t++)
+                mat[i*w + t] = mod(mat[i*w + t] - f * mat[c*w + t], PRIME);
+        }
+    }
+
+    for (size_t r = 0; r < k; r++)
+        for (size_t j = 0; j < k; j++)
+            inv[r*k + j] = mat[r*w + k + j];
     free(mat);
 
-    return bmp;
+    return inv;
 }
 
+/* Reveals blocks [from, to) into out, from the pixels of the k shadows and the
+ * inverse of their Vandermonde matrix. Like sharekernel(), the inner loop runs
+ * across KERNEL_LANES blocks */
 void
-hideshadow(Bitmap *bp, const Bitmap *shadow) {
-    char shadowfilename[20] = {0};
-    uint32_t pixels = bmpimagesize(shadow);
+revealkernel(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t to, uint8_t *out) {
+    uint32_t acc[KERNEL_LANES];
 
-    bp->bmpheader.unused1 = shadow->bmpheader.unused1;
-    bp->bmpheader.unused2 = shadow->bmpheader.unused2;
-    xsnprintf(shadowfilename, 20, "shadow%d.bmp", shadow->bmpheader.unused2);
+    for (size_t base = from; base < to; base += KERNEL_LANES) {
+        size_t nlanes = to - base < KERNEL_LANES ? to - base : KERNEL_LANES;
 
-    for (size_t i = 0; i < pixels; i++) {
-        uint8_t byte = shadow->imgpixels[i];
-        for (size_t j = i*8; j < 8*(i+1); j++) {
-            if (byte & 0x80) /* 1000 0000 */
-                RIGHTMOST_BIT_ON(bp->imgpixels[j]);
-            else
-                RIGHTMOST_BIT_OFF(bp->imgpixels[j]);
-            byte <<= 1;
+        for (size_t r = 0; r < k; r++) {
+            memset(acc, 0, sizeof(acc));
+            for (size_t j = 0; j < k; j++) {
+                const uint8_t *y = &shadows[j]->imgpixels[base];
+                uint32_t weight  = inv[r*k + j];
+                for (size_t b = 0; b < nlanes; b++)
+                    acc[b] += weight * y[b];
+            }
+            for (size_t b = 0; b < nlanes; b++)
+                out[(base - from + b) * k + r] = acc[b] % PRIME;
         }
     }
-    bmptofile(bp, shadowfilename);
 }
 
-/* width and height parameters needed because the image hiding the shadow could
- * be bigger than necessary */
-Bitmap *
-retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
-    uint16_t key          = bp->bmpheader.unused1;
-    uint16_t shadownumber = bp->bmpheader.unused2;
+void
+revealworker(void *arg, size_t from, size_t to) {
+    Revealjob *job = arg;
 
-    findclosestpair(calculatepixelarraysize(width, height)/k, &width, &height);
-    Bitmap *shadow = newshadow(width, height, key, shadownumber);
-    uint32_t shadowpixels = shadow->dibheader.pixelarraysize;
+    revealkernel(job->shadows, job->k, job->inv, job->from + from, job->from + to,
+            job->out + from * job->k);
+}
 
-    for (uint32_t i = 0; i < shadowpixels; i++) {
-        uint8_t byte = 0;
-        uint8_t mask = 0x80; /* 1000 0000 */
-        for (uint32_t j = i*8; j < 8*(i+1); j++) {
-            if (bp->imgpixels[j] & 0x01)
-                byte |= mask;
-            mask >>= 1;
+/* revealkernel() over nthreads threads */
+void
+revealblocks(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t to, uint8_t *out) {
+    Revealjob job = { .shadows = shadows, .k = k, .inv = inv, .from = from, .out = out };
+    double start = monotonic();
+
+    parallelfor(to - from, revealworker, &job);
+    stats.stage[STAGE_KERNEL] += monotonic() - start;
+}
+
+/* Reveals the size secret bytes whose blocks start at shadow pixel from. The
+ * zero padding of a last partial block is dropped */
+void
+revealbytes(Bitmap **shadows, uint16_t k, const int *inv, size_t from, size_t size, uint8_t *out) {
+    size_t full = size / k;
+
+    revealblocks(shadows, k, inv, from, from + full, out);
+    if (size % k) {
+        uint8_t *last = xmalloc(k);
+
+        revealblocks(shadows, k, inv, from + full, from + full + 1, last);
+        memcpy(out + full * k, last, size % k);
+        free(last);
+    }
+}
+
+/* Reads the CPUs of each NUMA node from sysfs. Node numbers may have gaps, so
+ * every node* entry is looked at, and nodes with only memory are left out as
+ * no thread can run on them. Without it, all the online CPUs make up a single
+ * node */
+void
+readtopology(void) {
+    char path[PATH_MAX];
+    DIR *dp = opendir("/sys/devices/system/node");
+    struct dirent *d;
+    FILE *fp;
+
+    while (dp && nnodes < MAX_NODES && (d = readdir(dp))) {
+        Node *node = &nodes[nnodes];
+        char list[4096], end;
+        int id;
+
+        if (sscanf(d->d_name, "node%d%c", &id, &end) != 1)
+            continue;
+        /* a list of ranges, such as 0-3,8-11 */
+        xsnprintf(path, PATH_MAX, "/sys/devices/system/node/%s/cpulist", d->d_name);
+        if (!(fp = fopen(path, "r")))
+            continue;
+        for (char *p = fgets(list, sizeof(list), fp); p && '0' <= *p && *p <= '9';) {
+            long lo = strtol(p, &p, 10);
+            long hi = *p == '-' ? strtol(p + 1, &p, 10) : lo;
+
+            for (long cpu = lo; cpu <= hi; cpu++) {
+                node->cpus = realloc(node->cpus, sizeof(*node->cpus) * (node->ncpus + 1));
+                if (!node->cpus)
+                    die("realloc: couldn't read the cpus of node %d\n", id);
+                node->cpus[node->ncpus++] = cpu;
+            }
+            if (*p == ',')
+                p++;
+        }
+        fclose(fp);
+        if (node->ncpus) {
+            node->id = id;
+            nnodes++;
         }
-        shadow->imgpixels[i] = byte;
     }
+    if (dp)
+        closedir(dp);
 
-    return shadow;
+    if (!nnodes) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nnodes = 1;
+        nodes[0].ncpus = ncpus > 0 ? ncpus : 1;
+        nodes[0].cpus  = xmalloc(sizeof(*nodes[0].cpus) * nodes[0].ncpus);
+        for (size_t i = 0; i < nodes[0].ncpus; i++)
+            nodes[0].cpus[i] = i;
+    }
 }
 
-bool
-isbmp(FILE *fp) {
-    char magicnumber[2];
-    long pos = ftell(fp);
+int
+cpunode(int cpu) {
+    for (size_t i = 0; i < nnodes; i++)
+        for (size_t j = 0; j < nodes[i].ncpus; j++)
+            if (nodes[i].cpus[j] == cpu)
+                return nodes[i].id;
 
-    xfseek(fp, 0, SEEK_SET);
-    xfread(magicnumber, sizeof(magicnumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+    return -1;
+}
 
-    return magicnumber[0] == 'B' && magicnumber[1] == 'M';
+void *
+runworker(void *arg) {
+    Worker *w = arg;
+
+    if (w->cpu != -1) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    w->fn(w->arg, w->from, w->to);
+    w->ran = sched_getcpu();
+
+    return NULL;
 }
 
-bool
-isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint16_t shadownumber;
-    long pos = ftell(fp);
+/* Runs fn over [0, nitems) split in one contiguous range per thread, the
+ * ranges being multiples of KERNEL_LANES. Threads write their own range of
+ * the output first, so on NUMA hosts its pages land on the node that thread
+ * runs on. With pinthreads, consecutive ranges go to the cpus of one node
+ * before moving to the next, so each node gets a contiguous part */
+void
+parallelfor(size_t nitems, void (*fn)(void *, size_t, size_t), void *arg) {
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    size_t lanes = (nitems + KERNEL_LANES - 1) / KERNEL_LANES;
+    size_t count = nthreads < lanes ? nthreads : lanes;
 
-    xfseek(fp, UNUSED2_OFFSET, SEEK_SET);
-    xfread(&shadownumber, sizeof(shadownumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+    if (count <= 1) {
+        fn(arg, 0, nitems);
+        return;
+    }
+    if (!nnodes)
+        readtopology();
 
-    return shadownumber && isbmp(fp) && isvalidbmpsize(fp, k, secretsize);
+    size_t chunk = (lanes + count - 1) / count * KERNEL_LANES;
+    for (size_t t = 0; t < count; t++) {
+        size_t node = t * nnodes / count;
+        size_t first = (node * count + nnodes - 1) / nnodes; /* first thread of node */
+
+        workers[t] = (Worker)
+            { .fn   = fn
+            , .arg  = arg
+            , .from = t * chunk < nitems ? t * chunk : nitems
+            , .to   = (t+1) * chunk < nitems ? (t+1) * chunk : nitems
+            , .cpu  = pinthreads ? nodes[node].cpus[(t - first) % nodes[node].ncpus] : -1
+            };
+        if (pthread_create(&tids[t], NULL, runworker, &workers[t]))
+            die("pthread_create: couldn't start thread %zu\n", t);
+    }
+    for (size_t t = 0; t < count; t++)
+        pthread_join(tids[t], NULL);
+
+    for (size_t t = 0; t < count && placement; t++)
+        fprintf(stderr, "thread %zu: items [%zu, %zu) on cpu %d, node %d%s\n",
+                t, workers[t].from, workers[t].to, workers[t].ran,
+                cpunode(workers[t].ran), workers[t].cpu != -1 ? " (pinned)" : "");
 }
 
-/* the last parameter is ignored, and is only present so that the function
- * prototype can be used with getvalidfilenames() */
-bool
-isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter) {
-    return isbmp(fp) && kdivisiblesize(fp, k);
+Bitmap *
+revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k) {
+    uint16_t flags = (*shadows)->bmpheader.unused2;
+    uint32_t size  = secretsize(width, height, flags);
+    Bitmap *bmp    = newbitmaphelper(width, height, (*shadows)->bmpheader.unused1, 0, size);
+    int *inv       = invertvandermonde(shadows, k);
+
+    revealbytes(shadows, k, inv, shadowpalette(flags), size, bmp->imgpixels);
+    xorbmpwithrandomtable(bmp, (*shadows)->bmpheader.unused1);
+    unpackbitmap(bmp, flags, (*shadows)->imgpixels);
+    free(inv);
+
+    return bmp;
+}
+
+/* Token bucket behind --rate: takes len bytes of I/O, sleeping once the
+ * bucket, which holds up to a second worth of them, runs dry. The time slept
+ * refills it on the next call */
+void
+throttle(size_t len) {
+    static double tokens;
+    static struct timespec last;
+    struct timespec now;
+
+    if (!ratelimit)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (last.tv_sec)
+        tokens += ((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9) * ratelimit;
+    if (!last.tv_sec || tokens > ratelimit)
+        tokens = ratelimit;
+    last    = now;
+    tokens -= len;
+
+    if (tokens < 0) {
+        double wait = -tokens / ratelimit;
+        struct timespec ts =
+            { .tv_sec  = wait
+            , .tv_nsec = (wait - floor(wait)) * 1e9
+            };
+        while (nanosleep(&ts, &ts))
+            ;
+    }
+}
+
+/* Moves the process to the idle cpu and I/O classes, or back to the normal
+ * ones, so that it only uses what its neighbours leave. Threads started
+ * afterwards inherit them */
+void
+setidle(bool idle) {
+    struct sched_param param = { .sched_priority = 0 };
+    int class = idle ? IOPRIO_CLASS_IDLE : IOPRIO_CLASS_BE;
+    int level = idle ? 0 : 4;
+
+    if (sched_setscheduler(0, idle ? SCHED_IDLE : SCHED_OTHER, &param)) {
+        /* leaving SCHED_IDLE takes CAP_SYS_NICE or a high enough RLIMIT_NICE */
+        if (idle || errno != EPERM)
+            die("sched_setscheduler: couldn't change the scheduling policy\n");
+        fprintf(stderr, "--no-idle: not allowed to leave the idle class; staying idle\n");
+        return;
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, class << IOPRIO_CLASS_SHIFT | level))
+        die("ioprio_set: couldn't change the I/O priority\n");
+}
+
+/* Expands template into buf, of PATH_MAX bytes: %n is num (the shadow or
+ * frame number), %j the job id and %% a '%'. Without --job, the job id is the
+ * pid, followed within a batch by the number of the job */
+void
+expandname(char *buf, const char *template, uint16_t num) {
+    size_t len = 0;
+
+    for (const char *t = template; *t && len < PATH_MAX - 1; t++) {
+        if (*t != '%' || !t[1]) {
+            buf[len++] = *t;
+            continue;
+        }
+        switch (*++t) {
+        case 'n':
+            len += xsnprintf(buf + len, PATH_MAX - len, "%d", num);
+            break;
+        case 'j':
+            if (jobid)
+                len += xsnprintf(buf + len, PATH_MAX - len, "%s", jobid);
+            else if (jobseq)
+                len += xsnprintf(buf + len, PATH_MAX - len, "%ld-%zu", (long)getpid(), jobseq);
+            else
+                len += xsnprintf(buf + len, PATH_MAX - len, "%ld", (long)getpid());
+            break;
+        case '%':
+            buf[len++] = '%';
+            break;
+        default:
+            die("unknown conversion %%%c in %s\n", *t, template);
+        }
+    }
+    buf[len] = '\0';
+}
+
+/* Writes the stego image of cover hiding len bytes. The cover itself is left
+ * untouched: only the LSBs of its first 8 * len bytes change, so those are
+ * built aside and the rest of the pixels are written straight from the cover */
+void
+hidebytes(const Bitmap *cover, const uint8_t *bytes, uint32_t len, uint16_t seed, uint16_t shadnum) {
+    char shadowfilename[PATH_MAX];
+
+    expandname(shadowfilename, nametemplate, SHADOWNUM(shadnum));
+    Output *out = outopen(shadowfilename);
+    hidebytesto(out, cover, bytes, len, seed, shadnum);
+    outclose(out);
+}
+
+/* appends to out the stego image of cover hiding len bytes */
+void
+hidebytesto(Output *out, const Bitmap *cover, const uint8_t *bytes, uint32_t len,
+        uint16_t seed, uint16_t shadnum) {
+    uint32_t coversize = bmpimagesize(cover);
+    uint8_t *stego     = xmalloc(8 * len);
+    Bitmap header      = *cover;
+
+    if (8 * len > coversize)
+        die("a cover of %u pixels can't hide %u bytes\n", coversize, len);
+
+    header.bmpheader.unused1 = seed;
+    header.bmpheader.unused2 = shadnum;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = bytes[i];
+        for (size_t j = i*8; j < 8*(i+1); j++) {
+            stego[j] = cover->imgpixels[j];
+            if (byte & 0x80) /* 1000 0000 */
+                RIGHTMOST_BIT_ON(stego[j]);
+            else
+                RIGHTMOST_BIT_OFF(stego[j]);
+            byte <<= 1;
+        }
+    }
+
+    if (outparallel(out, coversize)) {
+        off_t pixels = preamblesize(&header);
+
+        outwriteat(out, stego, 8 * len, pixels);
+        if (coversize > 8 * len)
+            outwriteat(out, cover->imgpixels + 8 * len, coversize - 8 * len, pixels + 8 * len);
+        outwritepreamble(out, &header);
+        xfseek(out->fp, 0, SEEK_END);
+    } else {
+        outwritepreamble(out, &header);
+        outwrite(out, stego, 8 * len);
+        if (coversize > 8 * len)
+            outwrite(out, cover->imgpixels + 8 * len, coversize - 8 * len);
+    }
+    free(stego);
+}
+
+void
+hideshadow(const Bitmap *cover, const Bitmap *shadow) {
+    hidebytes(cover, shadow->imgpixels, bmpimagesize(shadow),
+            shadow->bmpheader.unused1, shadow->bmpheader.unused2);
+}
+
+/* extracts len bytes from the LSBs of bp, starting at the from-th hidden byte */
+void
+retrievebytes(const Bitmap *bp, uint8_t *bytes, uint32_t from, uint32_t len) {
+    if (8 * (from + len) > bmpimagesize(bp))
+        die("can't retrieve %u bytes from a shadow of %u pixels\n", from + len, bmpimagesize(bp));
+
+    unhidebytes(bp->imgpixels + 8 * from, bytes, len);
+}
+
+/* takes len bytes from the LSBs of 8 * len stego pixels */
+void
+unhidebytes(const uint8_t *stego, uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = 0;
+        uint8_t mask = 0x80; /* 1000 0000 */
+        for (size_t j = i*8; j < 8*(i+1); j++) {
+            if (stego[j] & 0x01)
+                byte |= mask;
+            mask >>= 1;
+        }
+        bytes[i] = byte;
+    }
+}
+
+/* width and height parameters needed because the image hiding the shadow could
+ * be bigger than necessary */
+Bitmap *
+retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
+    uint16_t key          = bp->bmpheader.unused1;
+    /* the depth stays, for revealsecret() to rebuild the secret */
+    uint16_t shadownumber = bp->bmpheader.unused2 & ~(SHADOW_MULTI | SHADOW_TILED);
+
+    findclosestpair(shadowsize(secretsize(width, height, shadownumber), k, shadownumber), &width, &height);
+    Bitmap *shadow = newshadow(width, height, key, shadownumber);
+    retrievebytes(bp, shadow->imgpixels, 0, shadow->dibheader.pixelarraysize);
+
+    return shadow;
+}
+
+bool
+isbmp(FILE *fp) {
+    char magicnumber[2];
+    long pos = ftell(fp);
+
+    xfseek(fp, 0, SEEK_SET);
+    xfread(magicnumber, sizeof(magicnumber), 1, fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return magicnumber[0] == 'B' && magicnumber[1] == 'M';
+}
+
+bool
+isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
+    uint16_t shadownumber;
+    long pos = ftell(fp);
+
+    xfseek(fp, UNUSED2_OFFSET, SEEK_SET);
+    xfread(&shadownumber, sizeof(shadownumber), 1, fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return shadownumber && isbmp(fp) && isvalidbmpsize(fp, k, secretsize);
+}
+
+/* the last parameter is ignored, and is only present so that the function
+ * prototype can be used with getvalidfilenames() */
+bool
+isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter) {
+    return isbmp(fp) && kdivisiblesize(fp, k);
+}
+
+bool
+validvisit(void *arg, const char *path) {
+    Validwalk *w = arg;
+    FILE *fp     = xfopen(path, "r");
+
+    if (w->isvalid(fp, w->k, w->size))
+        w->filenames[w->len++] = xstrdup(path);
+    xfclose(fp);
+
+    return w->len < w->n;
+}
+
+char **
+getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
+    Validwalk w =
+        { .isvalid   = isvalid
+        , .k         = k
+        , .n         = n
+        , .size      = size
+        , .filenames = xmalloc(sizeof(*w.filenames) * n)
+        };
+
+    walkfiles(dir, NULL, minsize(size, k), validvisit, &w);
+
+    if (w.len < n)
+        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
+
+    return w.filenames;
+}
+
+/* Reads the header fields of a cover, without dying on whatever may show up
+ * in a watched directory: files still being written, or already gone */
+void
+validatecover(Coverentry *e) {
+    uint8_t header[HEIGHT_OFFSET + sizeof(e->height)];
+    FILE *fp = fopen(e->path, "r");
+
+    e->isbmp = false;
+    if (!fp)
+        return;
+    if (fread(header, sizeof(header), 1, fp) == 1 && header[0] == 'B' && header[1] == 'M') {
+        e->isbmp = true;
+        memcpy(&e->width, header + WIDTH_OFFSET, sizeof(e->width));
+        memcpy(&e->height, header + HEIGHT_OFFSET, sizeof(e->height));
+    }
+    fclose(fp);
+}
+
+/* add or revalidate the entry of name */
+void
+indexcover(Coverindex *ci, const char *name) {
+    char filepath[PATH_MAX] = {0};
+    struct stat st;
+    Coverentry *e = NULL;
+
+    xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, ci->dir, NAME_MAX, name);
+    if (lstat(filepath, &st) || !S_ISREG(st.st_mode)) {
+        unindexcover(ci, name);
+        return;
+    }
+
+    for (size_t i = 0; i < ci->len && !e; i++)
+        if (strcmp(ci->entries[i].name, name) == 0)
+            e = &ci->entries[i];
+
+    if (!e) {
+        if (ci->len == ci->cap) {
+            ci->cap     = ci->cap ? 2 * ci->cap : 64;
+            ci->entries = realloc(ci->entries, sizeof(*ci->entries) * ci->cap);
+            if (!ci->entries)
+                die("realloc: couldn't grow the cover index of %s\n", ci->dir);
+        }
+        e = &ci->entries[ci->len++];
+        e->name = strdup(name);
+        e->path = strdup(filepath);
+        if (!e->name || !e->path)
+            die("strdup: out of memory\n");
+    }
+    e->size = st.st_size;
+    validatecover(e);
+}
+
+void
+unindexcover(Coverindex *ci, const char *name) {
+    for (size_t i = 0; i < ci->len; i++) {
+        if (strcmp(ci->entries[i].name, name) == 0) {
+            free(ci->entries[i].name);
+            free(ci->entries[i].path);
+            memmove(&ci->entries[i], &ci->entries[i+1], sizeof(*ci->entries) * (ci->len - i - 1));
+            ci->len--;
+            return;
+        }
+    }
+}
+
+/* (re)build the index from scratch. The watch is added before listing the
+ * directory, so no change can fall between the two */
+void
+scancoverindex(Coverindex *ci) {
+    struct dirent *d;
+
+    if (ci->wd == -1)
+        ci->wd = inotify_add_watch(inotifyfd, ci->dir, COVERINDEX_EVENTS);
+    if (ci->wd == -1)
+        die("inotify_add_watch: couldn't watch %s\n", ci->dir);
+
+    for (size_t i = 0; i < ci->len; i++) {
+        free(ci->entries[i].name);
+        free(ci->entries[i].path);
+    }
+    ci->len = 0;
+
+    DIR *dp = xopendir(ci->dir);
+    while ((d = readdir(dp)))
+        if (d->d_type == DT_REG)
+            indexcover(ci, d->d_name);
+    xclosedir(dp);
+}
+
+/* Forgets the index of a directory that went away. Only a later coverindex()
+ * of it, which starts over, fails if it is still missing */
+void
+dropcoverindex(Coverindex *ci) {
+    for (size_t i = 0; i < ci->len; i++) {
+        free(ci->entries[i].name);
+        free(ci->entries[i].path);
+    }
+    free(ci->entries);
+    free(ci->dir);
+    *ci = coverindexes[--ncoverindexes];
+}
+
+/* Applies the pending inotify events, without blocking. Indexes left without
+ * a watch are rescanned by coverindex() when next asked for */
+void
+updatecoverindexes(void) {
+    _Alignas(struct inotify_event) char buf[4096];
+    const struct inotify_event *ev;
+    ssize_t len;
+
+    while ((len = read(inotifyfd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            Coverindex *ci = NULL;
+
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (size_t i = 0; i < ncoverindexes; i++)
+                    coverindexes[i].wd = -1;
+                continue;
+            }
+            for (size_t i = 0; i < ncoverindexes && !ci; i++)
+                if (coverindexes[i].wd == ev->wd)
+                    ci = &coverindexes[i];
+
+            if (!ci || (ev->mask & IN_ISDIR))
+                continue;
+            if (ev->mask & IN_IGNORED)
+                dropcoverindex(ci); /* directory removed or unmounted */
+            else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                unindexcover(ci, ev->name);
+            else
+                indexcover(ci, ev->name);
+        }
+    }
+}
+
+/* the up to date index of dir, built on first use. Directories are told
+ * apart by their canonical path, so covers and covers/ share one index */
+Coverindex *
+coverindex(const char *dir) {
+    char real[PATH_MAX];
+
+    if (!realpath(dir, real))
+        die("realpath: couldn't resolve %s\n", dir);
+    dir = real;
+    updatecoverindexes();
+
+    for (size_t i = 0; i < ncoverindexes; i++) {
+        if (strcmp(coverindexes[i].dir, dir) == 0) {
+            if (coverindexes[i].wd == -1)
+                scancoverindex(&coverindexes[i]);
+            return &coverindexes[i];
+        }
+    }
+
+    coverindexes = realloc(coverindexes, sizeof(*coverindexes) * (ncoverindexes + 1));
+    if (!coverindexes)
+        die("realloc: couldn't grow the cover indexes\n");
+
+    Coverindex *ci = &coverindexes[ncoverindexes++];
+    *ci = (Coverindex) { .dir = strdup(dir), .wd = -1 };
+    if (!ci->dir)
+        die("strdup: out of memory\n");
+    scancoverindex(ci);
+
+    return ci;
+}
+
+/* same selection as getvalidfilenames() with isvalidbmp(), from the index */
+char **
+getindexedfilenames(Coverindex *ci, uint16_t k, uint16_t n, uint32_t size) {
+    char **filenames = xmalloc(sizeof(*filenames) * n);
+    size_t i = 0;
+
+    for (size_t j = 0; j < ci->len && i < n; j++) {
+        const Coverentry *e = &ci->entries[j];
+        int pixels = e->width * e->height;
+
+        if (e->isbmp && e->size >= minsize(size, k) && pixels == (pixels / k) * k) {
+            filenames[i] = strdup(e->path);
+            if (!filenames[i])
+                die("strdup: out of memory\n");
+            i++;
+        }
+    }
+
+    if (i < n)
+        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, ci->dir);
+
+    return filenames;
+}
+
+char **
+getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size) {
+    if (useindex())
+        return getindexedfilenames(coverindex(dir), k, n, size);
+
+    return getvalidfilenames(dir, k, n, isvalidbmp, size);
+}
+
+/* whether path is on a network file system, by statfs(2) magic number */
+bool
+isremote(const char *path) {
+    static const long remotefs[] =
+        { 0x6969     /* NFS */
+        , 0x517B     /* SMB */
+        , 0xFF534D42 /* CIFS */
+        , 0xFE534D42 /* SMB2 */
+        , 0x00C36400 /* Ceph */
+        , 0x5346414F /* AFS */
+        , 0x65735546 /* FUSE */
+        };
+    struct statfs sfs;
+
+    if (statfs(path, &sfs))
+        return false;
+    for (size_t i = 0; i < sizeof(remotefs) / sizeof(*remotefs); i++)
+        if ((long)sfs.f_type == remotefs[i])
+            return true;
+
+    return false;
+}
+
+/* bytes of the first len of path that would have to come from the disk,
+ * according to mincore(2) */
+size_t
+missingbytes(const char *path, size_t len) {
+    long pagesize  = sysconf(_SC_PAGESIZE);
+    size_t pages   = (len + pagesize - 1) / pagesize;
+    size_t missing = len;
+    int fd         = open(path, O_RDONLY);
+
+    if (fd == -1 || !len)
+        return missing;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vec = xmalloc(pages);
+    if (map != MAP_FAILED && !mincore(map, len, vec)) {
+        missing = 0;
+        for (size_t i = 0; i < pages; i++)
+            if (!(vec[i] & 1))
+                missing += pagesize;
+    }
+    if (map != MAP_FAILED)
+        munmap(map, len);
+    free(vec);
+    xclose(fd);
+
+    return missing;
+}
+
+bool
+shadowvisit(void *arg, const char *path) {
+    Shadowwalk *w = arg;
+    FILE *fp      = xfopen(path, "r");
+    uint64_t size = w->size;
+    Bitmap header;
+
+    /* packed secrets need fewer bytes than they have pixels, and a palette */
+    readbmpheader(&header, fp);
+    rewind(fp);
+    uint16_t depth = SHADOWDEPTH(header.bmpheader.unused2);
+    if (size && depth != BITS_PER_PIXEL)
+        size = size * depth / 8 + w->k * shadowpalette(header.bmpheader.unused2);
+
+    if (isvalidshadow(fp, w->k, size)) {
+        w->cands = realloc(w->cands, sizeof(*w->cands) * (w->len + 1));
+        if (!w->cands)
+            die("realloc: out of memory\n");
+        w->cands[w->len] = (Candidate)
+            { .path    = xstrdup(path)
+            , .num     = header.bmpheader.unused2
+            , .seed    = header.bmpheader.unused1
+            , .remote  = isremote(path)
+            , .missing = missingbytes(path, header.bmpheader.offset + 8 * blockcount(size, w->k))
+            , .order   = w->len
+            };
+        w->len++;
+    }
+    xfclose(fp);
+
+    return true;
+}
+
+/* local before remote, then the fewest bytes to read from the disk */
+int
+candidatecmp(const void *a, const void *b) {
+    const Candidate *x = a, *y = b;
+
+    if (x->remote != y->remote)
+        return x->remote - y->remote;
+    if (x->missing != y->missing)
+        return x->missing < y->missing ? -1 : 1;
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* The shadows in dir, sorted by what reading them costs. Shadows with a
+ * number already taken (mod PRIME, which would make the system singular) in
+ * their distribution, told apart by seed and layout, are reported and skipped */
+Candidate *
+findshadows(const char *dir, uint16_t k, uint32_t size, size_t *found) {
+    Shadowwalk w = { .k = k, .size = size };
+
+    /* the shadows of a 1-bit secret fit covers 8 times smaller */
+    walkfiles(dir, NULL, minsize(size / BITS_PER_PIXEL, k), shadowvisit, &w);
+    qsort(w.cands, w.len, sizeof(*w.cands), candidatecmp);
+
+    /* drop duplicates, keeping the cheapest */
+    size_t len = 0;
+    for (size_t i = 0; i < w.len; i++) {
+        Candidate *c = &w.cands[i];
+        size_t j = 0;
+
+        while (j < len && !(w.cands[j].seed == c->seed
+                    && (w.cands[j].num & ~SHADOWNUM(0xFFFF)) == (c->num & ~SHADOWNUM(0xFFFF))
+                    && SHADOWNUM(w.cands[j].num) % PRIME == SHADOWNUM(c->num) % PRIME))
+            j++;
+        if (j < len) {
+            fprintf(stderr, "%s: same shadow number %d as %s, ignored\n",
+                    c->path, SHADOWNUM(c->num), w.cands[j].path);
+            free(c->path);
+        } else {
+            w.cands[len++] = *c;
+        }
+    }
+    *found = len;
+
+    return w.cands;
+}
+
+/* Picks k shadows of the same distribution from dir, the cheapest ones of
+ * the distribution with the most shadows. The others are reported and
+ * skipped */
+char **
+getshadowfilenames(const char *dir, uint16_t k, uint32_t size) {
+    size_t len, best = 0, bestcount = 0;
+    Candidate *cands = findshadows(dir, k, size, &len);
+
+    /* the distribution with the most shadows; on a tie, the cheapest */
+    for (size_t i = 0; i < len; i++) {
+        size_t count = 0;
+
+        for (size_t j = 0; j < len; j++)
+            count += cands[j].seed == cands[i].seed
+                && (cands[j].num & ~SHADOWNUM(0xFFFF)) == (cands[i].num & ~SHADOWNUM(0xFFFF));
+        if (count > bestcount) {
+            best      = i;
+            bestcount = count;
+        }
+    }
+    if (bestcount < k)
+        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, k, dir);
+
+    char **filenames = xmalloc(sizeof(*filenames) * k);
+    size_t taken     = 0;
+    for (size_t i = 0; i < len; i++) {
+        Candidate *c = &cands[i];
+
+        if (c->seed != cands[best].seed
+                || (c->num & ~SHADOWNUM(0xFFFF)) != (cands[best].num & ~SHADOWNUM(0xFFFF))) {
+            fprintf(stderr, "%s: shadow of another distribution (seed %d), ignored\n", c->path, c->seed);
+            free(c->path);
+        } else if (taken < k) {
+            filenames[taken++] = c->path;
+        } else {
+            free(c->path);
+        }
+    }
+    free(cands);
+
+    return filenames;
+}
+
+/* one hash per range of DIGEST_RANGE blocks of the secret pixels */
+uint64_t *
+digestranges(const Bitmap *bp, uint16_t k, uint32_t ranges) {
+    uint32_t size    = bmpimagesize(bp);
+    size_t rangesize = (size_t)DIGEST_RANGE * k;
+    uint64_t *hashes = xmalloc(sizeof(*hashes) * ranges);
+
+    for (size_t r = 0; r < ranges; r++) {
+        size_t from = r * rangesize;
+        size_t len  = size - from < rangesize ? size - from : rangesize;
+
+        hashes[r] = hash64(bp->imgpixels + from, len, 0);
+    }
+
+    return hashes;
+}
+
+void
+writedigest(const char *path, const DigestHeader *h, const uint64_t *hashes) {
+    FILE *fp = xfopen(path, "w");
+
+    xfwrite(h, sizeof(*h), 1, fp);
+    xfwrite(hashes, sizeof(*hashes), h->ranges, fp);
+    syncclose(fp, path);
+}
+
+void
+distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed,
+        const char *digestpath, bool tile) {
+    Bitmap *bmp, **shadows;
+
+    bmp = bmpfromfile(imgpath);
+    uint16_t depth = packbitmap(bmp);
+    if (tile && depth)
+        die("%s: only 8-bit images can be tiled\n", imgpath);
+    char ** filepaths = getbmpfilenames(dir, k, n, k * shadowsize(bmpimagesize(bmp), k, depth));
+    if (tile)
+        tilebitmap(bmp, false);
+    if (digestpath) {
+        uint32_t size = bmpimagesize(bmp);
+        DigestHeader h =
+            { .magic  = DIGEST_MAGIC
+            , .k      = k
+            , .n      = n
+            , .seed   = seed
+            , .size   = size
+            , .ranges = (blockcount(size, k) + DIGEST_RANGE - 1) / DIGEST_RANGE
+            };
+        uint64_t *hashes = digestranges(bmp, k, h.ranges);
+
+        writedigest(digestpath, &h, hashes);
+        free(hashes);
+    }
+    xorbmpwithrandomtable(bmp, seed);
+    shadows = formshadows(bmp, k, n, seed, depth);
+    freebitmap(bmp);
+
+    for (size_t i = 0; i < n; i++) {
+        if (tile)
+            shadows[i]->bmpheader.unused2 |= SHADOW_TILED;
+        prefetchcover(filepaths, i, n);
+        bmp = coverfromfile(filepaths[i]);
+        hideshadow(bmp, shadows[i]);
+        freecover(bmp);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(shadows);
+}
+
+/* Rewrites in place the LSBs of the stego image at path that hide the shadow
+ * pixels [from, to); pixels holds just those */
+void
+patchshadow(const char *path, const uint8_t *pixels, uint32_t from, uint32_t to) {
+    Bitmap header;
+    uint32_t len  = 8 * (to - from);
+    uint8_t *buf  = xmalloc(len);
+    FILE *fp      = xfopen(path, "r+");
+
+    readbmpheader(&header, fp);
+    throttle(2 * len);
+    xfseek(fp, header.bmpheader.offset + 8 * from, SEEK_SET);
+    xfread(buf, len, 1, fp);
+
+    for (size_t i = 0; i < to - from; i++) {
+        uint8_t byte = pixels[i];
+        for (size_t j = i*8; j < 8*(i+1); j++) {
+            if (byte & 0x80) /* 1000 0000 */
+                RIGHTMOST_BIT_ON(buf[j]);
+            else
+                RIGHTMOST_BIT_OFF(buf[j]);
+            byte <<= 1;
+        }
+    }
+
+    xfseek(fp, header.bmpheader.offset + 8 * from, SEEK_SET);
+    xfwrite(buf, len, 1, fp);
+    syncclose(fp, path);
+    free(buf);
+}
+
+/* Redistributes a modified secret by comparing it against the digest written
+ * when it was first distributed: only the blocks of ranges whose hash changed
+ * are shared again, and only their LSBs are patched in the stego images */
+void
+updateimage(const char *dir, const char *imgpath, const char *digestpath, uint16_t k) {
+    DigestHeader h;
+    FILE *fp = xfopen(digestpath, "r");
+
+    xfread(&h, sizeof(h), 1, fp);
+    if (memcmp(h.magic, DIGEST_MAGIC, sizeof(h.magic)))
+        die("%s: not a digest file\n", digestpath);
+    uint64_t *hashes = xmalloc(sizeof(*hashes) * h.ranges);
+    xfread(hashes, sizeof(*hashes), h.ranges, fp);
+    xfclose(fp);
+
+    Bitmap *bmp      = bmpfromfile(imgpath);
+    uint16_t depth   = packbitmap(bmp);
+    uint32_t size    = bmpimagesize(bmp);
+    uint32_t palette = shadowpalette(depth);
+    if (h.k != k || h.size != size)
+        die("%s was distributed with k = %d and %u pixel bytes, not k = %d and %u\n",
+                digestpath, h.k, h.size, k, size);
+
+    /* shadow files of this distribution, by shadow number */
+    uint32_t rows    = bmp->dibheader.height < 0 ? -bmp->dibheader.height : bmp->dibheader.height;
+    size_t ncands;
+    Candidate *cands = findshadows(dir, k, bmp->dibheader.width * rows, &ncands);
+    char **byshadow  = xmalloc(sizeof(*byshadow) * h.n);
+    uint16_t flags   = 0;
+    bool taken       = false;
+    memset(byshadow, 0, sizeof(*byshadow) * h.n);
+    for (size_t i = 0; i < ncands; i++) {
+        Candidate *c    = &cands[i];
+        uint16_t num    = SHADOWNUM(c->num);
+        uint16_t layout = c->num & ~SHADOWNUM(0xFFFF);
+
+        fp = xfopen(c->path, "r");
+        bool fits = isvalidbmpsize(fp, k, k * shadowsize(size, k, depth));
+        xfclose(fp);
+        if (c->seed != h.seed || (taken && layout != flags) || (layout & SHADOW_MULTI)
+                || (layout & (SHADOW_1BIT | SHADOW_4BIT)) != depth) {
+            fprintf(stderr, "%s: shadow of another distribution (seed %d), ignored\n", c->path, c->seed);
+            free(c->path);
+        } else if (!fits) {
+            fprintf(stderr, "%s: too small for a shadow of %s, ignored\n", c->path, imgpath);
+            free(c->path);
+        } else if (!num || num > h.n || byshadow[num-1]) {
+            fprintf(stderr, "%s: shadow number %d not in 1..%d or repeated, ignored\n", c->path, num, h.n);
+            free(c->path);
+        } else {
+            byshadow[num-1] = c->path;
+            flags           = layout;
+            taken           = true;
+        }
+    }
+    free(cands);
+    for (size_t i = 0; i < h.n; i++)
+        if (!byshadow[i])
+            die("shadow %zu of the (%d,%d) distribution with seed %d not found in dir %s\n",
+                    i + 1, k, h.n, h.seed, dir);
+    if (flags & SHADOW_TILED)
+        tilebitmap(bmp, false);
+
+    uint64_t *newhashes = digestranges(bmp, k, h.ranges);
+    const uint8_t *table = keystream(h.seed, size);
+    uint32_t blocks      = blockcount(size, k);
+    uint8_t *patch       = xmalloc(h.n * DIGEST_RANGE);
+    uint8_t **out        = xmalloc(sizeof(*out) * h.n);
+
+    for (size_t i = 0; i < h.n; i++) {
+        out[i] = &patch[i * DIGEST_RANGE];
+        /* the palette isn't in the digest; it is cheaper to just rewrite it */
+        if (palette)
+            patchshadow(byshadow[i], bmp->palette, 0, palette);
+    }
+
+    for (uint32_t r = 0; r < h.ranges; r++) {
+        if (newhashes[r] == hashes[r])
+            continue;
+
+        uint32_t from = r * DIGEST_RANGE;
+        uint32_t to   = blocks - from < DIGEST_RANGE ? blocks : from + DIGEST_RANGE;
+
+        size_t end = (size_t)to * k < size ? (size_t)to * k : size;
+
+        for (size_t i = from * k; i < end; i++)
+            bmp->imgpixels[i] ^= table[i];
+        sharebytes(&bmp->imgpixels[from * k], end - from * k, k, h.n, out, 0);
+        for (size_t i = 0; i < h.n; i++)
+            patchshadow(byshadow[i], out[i], palette + from, palette + to);
+    }
+    writedigest(digestpath, &h, newhashes);
+
+    for (size_t i = 0; i < h.n; i++)
+        free(byshadow[i]);
+    free(byshadow);
+    free(hashes);
+    free(newhashes);
+    free(patch);
+    free(out);
+    freebitmap(bmp);
+}
+
+/* little endian encoding of the multi-secret index */
+void
+putle(uint8_t *p, uint32_t value, size_t nbytes) {
+    for (size_t i = 0; i < nbytes; i++, value >>= 8)
+        p[i] = value & 0xFF;
+}
+
+uint32_t
+getle(const uint8_t *p, size_t nbytes) {
+    uint32_t value = 0;
+
+    for (size_t i = nbytes; i > 0; i--)
+        value = value << 8 | p[i-1];
+
+    return value;
+}
+
+/* Shares several secrets into the same n covers at once. Each cover hides an
+ * index followed by the shadow of every secret, one after the other:
+ *
+ *     magic[4] count[1] { width[4] height[4] offset[4] seed[2] }[count]
+ *
+ * where offset is the hidden byte at which the shadow of that secret starts.
+ * Secret s is ciphered with seed + s, so no two secrets share a keystream.
+ * Shadow bytes are one per block, so the blocks of all the secrets are packed
+ * together and shared in a single shareblocks() call, which lays each shadow
+ * out exactly as it is hidden. Tiny secrets fill the kernel's lanes as well as
+ * a big one does */
+void
+distributeimages(const char *dir, char **imgpaths, size_t count, uint16_t k, uint16_t n, uint16_t seed) {
+    uint32_t indexsize = MULTI_HEADER_SIZE + MULTI_ENTRY_SIZE * count;
+    uint32_t len       = indexsize;
+    uint8_t **out      = xmalloc(sizeof(*out) * n);
+    uint8_t *packed    = NULL;
+    uint8_t index[MULTI_INDEX_MAX];
+
+    char **filepaths = getbmpfilenames(dir, k, n, 0);
+
+    memcpy(index, MULTI_MAGIC, 4);
+    index[4] = count;
+    for (size_t s = 0; s < count; s++) {
+        uint8_t *entry = index + MULTI_HEADER_SIZE + MULTI_ENTRY_SIZE * s;
+        uint16_t sseed = seed + s;
+        Bitmap *bmp    = bmpfromfile(imgpaths[s]);
+        uint32_t size  = bmpimagesize(bmp);
+        size_t blocks  = blockcount(size, k);
+
+        if (bmp->dibheader.depth == 1 || bmp->dibheader.depth == 4)
+            die("%s: only 8-bit images can share covers with others\n", imgpaths[s]);
+
+        putle(entry, bmp->dibheader.width, 4);
+        putle(entry + 4, bmp->dibheader.height, 4);
+        putle(entry + 8, len, 4);
+        putle(entry + 12, sseed, 2);
+
+        xorbmpwithrandomtable(bmp, sseed);
+        packed = realloc(packed, (len - indexsize + blocks) * k);
+        if (!packed)
+            die("realloc: couldn't allocate the secrets\n");
+        /* a last partial block is padded with zeros */
+        memset(packed + (len - indexsize + blocks - 1) * k, 0, k);
+        memcpy(packed + (len - indexsize) * k, bmp->imgpixels, size);
+        len += blocks;
+        freebitmap(bmp);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = xmalloc(len);
+        memcpy(out[i], index, indexsize);
+    }
+    shareblocks(packed, len - indexsize, k, n, out, indexsize);
+    free(packed);
+
+    for (size_t i = 0; i < n; i++) {
+        prefetchcover(filepaths, i, n);
+        Bitmap *cover = coverfromfile(filepaths[i]);
+        hidebytes(cover, out[i], len, seed, (i+1) | SHADOW_MULTI);
+        freecover(cover);
+        free(filepaths[i]);
+        free(out[i]);
+    }
+    free(filepaths);
+    free(out);
+}
+
+/* recovers the index-th secret (from 1) of shadows made by distributeimages() */
+void
+recoverimageat(const char *dir, const char *filename, uint16_t k, uint16_t index) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+    uint8_t header[MULTI_INDEX_MAX];
+    uint32_t width, offset;
+    int32_t height;
+    uint16_t seed;
+
+    char **filepaths = getshadowfilenames(dir, k, 0);
+    for (size_t i = 0; i < k; i++) {
+        Bitmap *bp = bmpfromfile(filepaths[i]);
+
+        if (!(bp->bmpheader.unused2 & SHADOW_MULTI))
+            die("%s doesn't hide several secrets\n", filepaths[i]);
+        if (i == 0) {
+            retrievebytes(bp, header, 0, MULTI_HEADER_SIZE);
+            if (memcmp(header, MULTI_MAGIC, 4))
+                die("%s: corrupt multi-secret index\n", filepaths[i]);
+            if (index < 1 || index > header[4])
+                die("%s hides %d secrets; can't recover secret %d\n", filepaths[i], header[4], index);
+
+            uint8_t *entry = header + MULTI_HEADER_SIZE;
+            retrievebytes(bp, entry, MULTI_HEADER_SIZE + MULTI_ENTRY_SIZE * (index-1), MULTI_ENTRY_SIZE);
+            width  = getle(entry, 4);
+            height = getle(entry + 4, 4);
+            offset = getle(entry + 8, 4);
+            seed   = getle(entry + 12, 2);
+        }
+
+        uint32_t swidth;
+        int32_t sheight;
+        findclosestpair(blockcount(calculatepixelarraysize(width, height), k), &swidth, &sheight);
+        shadows[i] = newshadow(swidth, sheight, seed, SHADOWNUM(bp->bmpheader.unused2));
+        retrievebytes(bp, shadows[i]->imgpixels, offset, bmpimagesize(shadows[i]));
+        freebitmap(bp);
+    }
+
+    Bitmap *bmp = revealsecret(shadows, width, height, k);
+    bmptofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t i = 0; i < k; i++) {
+        free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(shadows);
+}
+
+/* Frame-sequence mode. Frame f of template (%n is f, from 1, up to the first
+ * missing one) is shared as a secret of its own, ciphered with seed + f - 1,
+ * and its stego images are appended to one container per shadow, named by
+ * --name (shadow%n.seq by default). The covers are picked and read once for
+ * the whole sequence and the containers stay open across frames, so a frame
+ * only costs its own read, sharing and write. The next frame is read ahead
+ * while the current one is being shared */
+void
+distributesequence(const char *dir, const char *template, uint16_t k, uint16_t n, uint16_t seed) {
+    const char *name = strcmp(nametemplate, DEFAULT_NAME) ? nametemplate : DEFAULT_SEQNAME;
+    char (*names)[PATH_MAX] = xmalloc(sizeof(*names) * n);
+    Bitmap **covers  = xmalloc(sizeof(*covers) * n);
+    Output **outs    = xmalloc(sizeof(*outs) * n);
+    char frame[PATH_MAX], next[PATH_MAX];
+
+    expandname(frame, template, 1);
+    expandname(next, template, 2);
+    if (!strcmp(frame, next))
+        die("%s: the frames of a sequence must be numbered with %%n\n", template);
+
+    Bitmap *bmp    = bmpfromfile(frame);
+    uint16_t depth = packbitmap(bmp);
+    uint32_t size  = bmpimagesize(bmp);
+    char **filepaths = getbmpfilenames(dir, k, n, k * shadowsize(size, k, depth));
+    for (size_t i = 0; i < n; i++) {
+        prefetchcover(filepaths, i, n);
+        covers[i] = bmpfromfile(filepaths[i]);
+        expandname(names[i], name, i + 1);
+        outs[i] = outopen(names[i]);
+    }
+
+    for (uint16_t f = 1; bmp; f++) {
+        uint16_t fseed = seed + f - 1;
+
+        if (bmpimagesize(bmp) != size)
+            die("%s: all the frames must have the size and depth of the first\n", frame);
+        expandname(next, template, f + 1);
+        prefetchfile(next);
+
+        xorbmpwithrandomtable(bmp, fseed);
+        Bitmap **shadows = formshadows(bmp, k, n, fseed, depth);
+        freebitmap(bmp);
+        for (size_t i = 0; i < n; i++) {
+            hidebytesto(outs[i], covers[i], shadows[i]->imgpixels, bmpimagesize(shadows[i]),
+                    shadows[i]->bmpheader.unused1, shadows[i]->bmpheader.unused2);
+            freebitmap(shadows[i]);
+        }
+        free(shadows);
+
+        bmp = NULL;
+        if (f < UINT16_MAX && !access(next, F_OK)) {
+            memcpy(frame, next, sizeof(frame));
+            bmp = bmpfromfile(frame);
+            if (packbitmap(bmp) != depth)
+                die("%s: all the frames must have the size and depth of the first\n", frame);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        outclose(outs[i]);
+        freebitmap(covers[i]);
+        free(filepaths[i]);
+    }
+    free(filepaths);
+    free(covers);
+    free(outs);
+    free(names);
+}
+
+/* Recovers every frame in the sequence containers of dir into template (%n
+ * is the frame number, from 1). The containers are read in step, a frame at a
+ * time, and the system of the shadow numbers, the same for every frame, is
+ * inverted only once */
+void
+recoversequence(const char *dir, const char *template, uint32_t width, int32_t height, uint16_t k) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+    FILE **fps       = xmalloc(sizeof(*fps) * k);
+    uint16_t *nums   = xmalloc(sizeof(*nums) * k);
+    int *inv         = NULL;
+    char frame[PATH_MAX];
+
+    char **filepaths = getshadowfilenames(dir, k, width * height);
+    for (size_t i = 0; i < k; i++)
+        fps[i] = xfopen(filepaths[i], "r");
+
+    for (uint16_t f = 1;; f++) {
+        size_t got = 0;
+
+        for (size_t i = 0; i < k; i++) {
+            Bitmap *bp = bmpfromfp(fps[i]);
+
+            if (!bp)
+                continue;
+            if (bp->bmpheader.unused2 & (SHADOW_MULTI | SHADOW_TILED))
+                die("%s: frame %d isn't a plain shadow\n", filepaths[i], f);
+            if (inv && bp->bmpheader.unused2 != nums[i])
+                die("%s: frame %d is of another shadow\n", filepaths[i], f);
+            nums[i]    = bp->bmpheader.unused2;
+            shadows[i] = retrieveshadow(bp, width, height, k);
+            freebitmap(bp);
+            got++;
+        }
+        if (!got)
+            break;
+        if (got < k)
+            die("the containers in %s hold different numbers of frames\n", dir);
+
+        if (!inv)
+            inv = invertvandermonde(shadows, k);
+        uint16_t seed  = shadows[0]->bmpheader.unused1;
+        uint16_t flags = shadows[0]->bmpheader.unused2;
+        uint32_t size  = secretsize(width, height, flags);
+        Bitmap *bmp    = newbitmaphelper(width, height, seed, 0, size);
+        revealbytes(shadows, k, inv, shadowpalette(flags), size, bmp->imgpixels);
+        xorbmpwithrandomtable(bmp, seed);
+        unpackbitmap(bmp, flags, shadows[0]->imgpixels);
+        expandname(frame, template, f);
+        bmptofile(bmp, frame);
+        freebitmap(bmp);
+        for (size_t i = 0; i < k; i++)
+            freebitmap(shadows[i]);
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        xfclose(fps[i]);
+        free(filepaths[i]);
+    }
+    free(filepaths);
+    free(shadows);
+    free(fps);
+    free(nums);
+    free(inv);
+}
+
+Sharer *
+newsharer(uint16_t k, uint16_t n, uint16_t seed, size_t size, Stripefn emit, void *ctx) {
+    Sharer *s = xmalloc(sizeof(*s));
+
+    *s = (Sharer)
+        { .k    = k
+        , .n    = n
+        , .seed = seed
+        , .size = size
+        , .buf  = xmalloc(k * STREAM_BLOCKS)
+        , .out  = xmalloc(sizeof(*s->out) * n)
+        , .emit = emit
+        , .ctx  = ctx
+        };
+    for (size_t i = 0; i < n; i++)
+        s->out[i] = xmalloc(STREAM_BLOCKS);
+
+    return s;
+}
+
+/* shares the whole blocks of the stripe being filled. The zero padding of a
+ * last partial block, added by finishsharer(), isn't ciphered, as with
+ * formshadows() */
+void
+flushsharer(Sharer *s) {
+    size_t blocks = s->fill / s->k;
+    size_t len    = blocks * s->k;
+
+    if (!blocks)
+        return;
+
+    /* the pointer is only valid until the next keystream() call */
+    const uint8_t *table = keystream(s->seed, s->size);
+    for (size_t i = 0; i < len && s->done + i < s->size; i++)
+        s->buf[i] ^= table[s->done + i];
+    shareblocks(s->buf, blocks, s->k, s->n, s->out, 0);
+
+    for (size_t i = 0; i < s->n; i++)
+        s->emit(s->ctx, i, s->out[i], s->done / s->k, blocks);
+    memmove(s->buf, s->buf + len, s->fill - len);
+    s->done += len;
+    s->fill -= len;
+}
+
+void
+sharerpush(Sharer *s, const uint8_t *pixels, size_t len) {
+    size_t cap = (size_t)s->k * STREAM_BLOCKS;
+
+    if (len > s->size - s->done - s->fill)
+        die("sharer: pushed more than the %zu pixels of the secret\n", s->size);
+    while (len) {
+        size_t n = cap - s->fill < len ? cap - s->fill : len;
+
+        memcpy(s->buf + s->fill, pixels, n);
+        s->fill += n;
+        pixels  += n;
+        len     -= n;
+        if (s->fill == cap)
+            flushsharer(s);
+    }
+}
+
+/* shares what is left, padding a last partial block with zeros, and frees s */
+void
+finishsharer(Sharer *s) {
+    size_t tail = s->fill % s->k;
+
+    if (tail) {
+        memset(s->buf + s->fill, 0, s->k - tail);
+        s->fill += s->k - tail;
+    }
+    flushsharer(s);
+    for (size_t i = 0; i < s->n; i++)
+        free(s->out[i]);
+    free(s->out);
+    free(s->buf);
+    free(s);
+}
+
+/* shadownums holds the number of each of the k shadows to be pushed, and seed
+ * the one they were shared with */
+Revealer *
+newrevealer(uint16_t k, const uint16_t *shadownums, uint16_t seed, size_t size,
+        Rowsfn emit, void *ctx) {
+    Revealer *r = xmalloc(sizeof(*r));
+
+    *r = (Revealer)
+        { .k       = k
+        , .seed    = seed
+        , .size    = size
+        , .shadows = xmalloc(sizeof(*r->shadows) * k)
+        , .ptrs    = xmalloc(sizeof(*r->ptrs) * k)
+        , .fill    = xmalloc(sizeof(*r->fill) * k)
+        , .out     = xmalloc(k * STREAM_BLOCKS)
+        , .emit    = emit
+        , .ctx     = ctx
+        };
+    for (size_t i = 0; i < k; i++) {
+        r->shadows[i].bmpheader.unused2 = shadownums[i];
+        r->shadows[i].imgpixels         = xmalloc(STREAM_BLOCKS);
+        r->ptrs[i] = &r->shadows[i];
+        r->fill[i] = 0;
+    }
+    r->inv = invertvandermonde(r->ptrs, k);
+
+    return r;
+}
+
+/* Pushes the next len stego pixels of the i-th shadow (from 0), and returns
+ * how many were taken. The rest, be it a trailing part of a hidden byte or
+ * what doesn't fit until the other shadows catch up, must be pushed again.
+ * Pixels past the end of the shadow are taken and ignored */
+size_t
+revealerpush(Revealer *r, size_t i, const uint8_t *stego, size_t len) {
+    size_t blocks = blockcount(r->size, r->k);
+    size_t left   = blocks - r->done - r->fill[i];
+    size_t room   = STREAM_BLOCKS - r->fill[i];
+    size_t n      = len / 8 < room ? len / 8 : room;
+
+    if (!left)
+        return len;
+    if (n > left)
+        n = left;
+    unhidebytes(stego, r->shadows[i].imgpixels + r->fill[i], n);
+    r->fill[i] += n;
+
+    size_t ready = STREAM_BLOCKS;
+    for (size_t j = 0; j < r->k; j++)
+        if (r->fill[j] < ready)
+            ready = r->fill[j];
+    if (ready == STREAM_BLOCKS || (ready && r->done + ready == blocks)) {
+        size_t from = r->done * r->k;
+        size_t bytes = ready * r->k < r->size - from ? ready * r->k : r->size - from;
+
+        /* the padding of a last partial block is dropped */
+        revealblocks(r->ptrs, r->k, r->inv, 0, ready, r->out);
+        const uint8_t *table = keystream(r->seed, r->size);
+        for (size_t j = 0; j < bytes; j++)
+            r->out[j] ^= table[from + j];
+        for (size_t j = 0; j < r->k; j++) {
+            memmove(r->shadows[j].imgpixels, r->shadows[j].imgpixels + ready, r->fill[j] - ready);
+            r->fill[j] -= ready;
+        }
+        r->done += ready;
+        r->emit(r->ctx, r->out, from, bytes);
+    }
+
+    return n == left && 8 * n < len ? len : 8 * n;
+}
+
+void
+freerevealer(Revealer *r) {
+    for (size_t i = 0; i < r->k; i++)
+        free(r->shadows[i].imgpixels);
+    free(r->shadows);
+    free(r->ptrs);
+    free(r->fill);
+    free(r->inv);
+    free(r->out);
+    free(r);
+}
+
+/* the rows recovered by the Revealer of reshareimage() go to its Sharer */
+void
+resharerows(void *ctx, const uint8_t *pixels, size_t from, size_t len) {
+    sharerpush(ctx, pixels, len);
+}
+
+/* the stripes of the Sharer of reshareimage() go to the new shadows */
+void
+resharestripe(void *ctx, size_t i, const uint8_t *pixels, size_t from, size_t len) {
+    Bitmap **shadows = ctx;
+    uint32_t palette = shadowpalette(shadows[i]->bmpheader.unused2);
+
+    memcpy(shadows[i]->imgpixels + palette + from, pixels, len);
+}
+
+/* Moves the secret hidden in the stego images of dir to a (newk, n) scheme,
+ * hiding the new shadows in the images of coverdir. The secret never exists
+ * whole: the old stego images are streamed through a Revealer into a Sharer */
+void
+reshareimage(const char *dir, const char *coverdir, uint32_t width, int32_t height,
+        uint16_t k, uint16_t newk, uint16_t n, uint16_t seed) {
+    uint32_t size      = 0;
+    FILE **fps         = xmalloc(sizeof(*fps) * k);
+    uint16_t *nums     = xmalloc(sizeof(*nums) * k);
+    Bitmap **shadows   = xmalloc(sizeof(*shadows) * n);
+    uint8_t *buf       = xmalloc(8 * STREAM_BLOCKS);
+    uint16_t layout    = 0, oldseed = 0;
+    uint8_t palette[4 << 4];
+    uint32_t swidth;
+    int32_t sheight;
+
+    char **filepaths = getshadowfilenames(dir, k, width * height);
+    for (size_t i = 0; i < k; i++) {
+        Bitmap header;
+
+        fps[i] = xfopen(filepaths[i], "r");
+        readbmpheader(&header, fps[i]);
+        readdibheader(&header, fps[i]);
+        if (header.bmpheader.unused2 & SHADOW_MULTI)
+            die("%s hides several secrets, which can't be reshared\n", filepaths[i]);
+        layout = header.bmpheader.unused2 & (SHADOW_TILED | SHADOW_1BIT | SHADOW_4BIT);
+        size   = secretsize(width, height, layout);
+        if (8 * shadowsize(size, k, layout) > bmpimagesize(&header))
+            die("can't retrieve %u bytes from a shadow of %u pixels\n",
+                    shadowsize(size, k, layout), bmpimagesize(&header));
+        nums[i] = SHADOWNUM(header.bmpheader.unused2);
+        oldseed = header.bmpheader.unused1;
+        xfseek(fps[i], header.bmpheader.offset, SEEK_SET);
+
+        /* every shadow of a packed secret holds the same palette */
+        if (shadowpalette(layout)) {
+            xfread(buf, 8 * shadowpalette(layout), 1, fps[i]);
+            unhidebytes(buf, palette, shadowpalette(layout));
+        }
+    }
+    char **coverpaths = getbmpfilenames(coverdir, newk, n, newk * shadowsize(size, newk, layout));
+
+    /* blocks keep their order, so tiled (or packed) shadows give tiled (or
+     * packed) shadows */
+    findclosestpair(shadowsize(size, newk, layout), &swidth, &sheight);
+    for (size_t i = 0; i < n; i++) {
+        shadows[i] = newshadow(swidth, sheight, seed, (i+1) | layout);
+        memcpy(shadows[i]->imgpixels, palette, shadowpalette(layout));
+    }
+
+    Sharer *sharer     = newsharer(newk, n, seed, size, resharestripe, shadows);
+    Revealer *revealer = newrevealer(k, nums, oldseed, size, resharerows, sharer);
+    for (size_t left = 8 * blockcount(size, k); left;) {
+        size_t len   = left < 8 * STREAM_BLOCKS ? left : 8 * STREAM_BLOCKS;
+        double start = monotonic();
+
+        for (size_t i = 0; i < k; i++) {
+            throttle(len);
+            xfread(buf, len, 1, fps[i]);
+            stats.bytesread += len;
+            if (revealerpush(revealer, i, buf, len) != len)
+                die("reshare: the stripes of the shadows are out of step\n");
+        }
+        stats.stage[STAGE_READ] += monotonic() - start;
+        left -= len;
+    }
+    freerevealer(revealer);
+    finishsharer(sharer);
+
+    for (size_t i = 0; i < n; i++) {
+        prefetchcover(coverpaths, i, n);
+        Bitmap *cover = coverfromfile(coverpaths[i]);
+        hideshadow(cover, shadows[i]);
+        freecover(cover);
+        free(coverpaths[i]);
+        freebitmap(shadows[i]);
+    }
+    for (size_t i = 0; i < k; i++) {
+        xfclose(fps[i]);
+        free(filepaths[i]);
+    }
+    free(coverpaths);
+    free(filepaths);
+    free(fps);
+    free(nums);
+    free(shadows);
+    free(buf);
+}
+
+int
+sharekeycmp(const void *a, const void *b) {
+    const Sharekey *x = a;
+    const Sharekey *y = b;
+
+    return (x->shadownumber > y->shadownumber) - (x->shadownumber < y->shadownumber);
+}
+
+void
+recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+    Bitmap *bmp      = NULL;
+    Revealkey *key   = NULL;
+    size_t keylen    = sizeof(*key) + sizeof(key->shares[0]) * k;
+    uint16_t tiled   = 0;
+
+    char **filepaths = getshadowfilenames(dir, k, width * height);
+    for (size_t i = 0; i < k; i++) {
+        Bitmap *bp = bmpfromfile(filepaths[i]);
+        if (bp->bmpheader.unused2 & SHADOW_MULTI)
+            die("%s hides several secrets; choose one with --index\n", filepaths[i]);
+        tiled = bp->bmpheader.unused2 & SHADOW_TILED;
+        shadows[i] = retrieveshadow(bp, width, height, k);
+        freebitmap(bp);
+    }
+
+    /* the same shares always reveal the same secret, whatever their order */
+    if (revealcache.maxsize) {
+        key  = xmalloc(keylen);
+        *key = (Revealkey) { .width = width, .height = height, .k = k, .flags = tiled };
+        for (size_t i = 0; i < k; i++) {
+            key->shares[i] = (Sharekey)
+                { .shadownumber = shadows[i]->bmpheader.unused2
+                , .seed         = shadows[i]->bmpheader.unused1
+                , .hash         = hash64(shadows[i]->imgpixels, bmpimagesize(shadows[i]), 0)
+                , .check        = hash64(shadows[i]->imgpixels, bmpimagesize(shadows[i]), SHAREKEY_CHECK_SEED)
+                };
+        }
+        qsort(key->shares, k, sizeof(key->shares[0]), sharekeycmp);
+        bmp = cacheget(&revealcache, key, keylen);
+    }
+
+    if (bmp) {
+        bmptofile(bmp, filename);
+    } else {
+        bmp = revealsecret(shadows, width, height, k);
+        if (tiled)
+            tilebitmap(bmp, true);
+        bmptofile(bmp, filename);
+        if (key)
+            cacheput(&revealcache, key, keylen, bmp);
+        else
+            freebitmap(bmp);
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(shadows);
+    free(key);
+}
+
+void
+cacheunlink(Bitmapcache *c, Cacheentry *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+/* returns the bitmap stored under key, or NULL. The bitmap stays owned by the
+ * cache, and is valid until the next cacheput() */
+Bitmap *
+cacheget(Bitmapcache *c, const void *key, size_t keylen) {
+    for (Cacheentry *e = c->head; e; e = e->next) {
+        if (e->keylen == keylen && memcmp(e->key, key, keylen) == 0) {
+            cacheunlink(c, e);
+            e->prev = NULL;
+            e->next = c->head;
+            if (c->head)
+                c->head->prev = e;
+            c->head = e;
+            if (!c->tail)
+                c->tail = e;
+            c->hits++;
+            return e->bmp;
+        }
+    }
+    c->misses++;
+
+    return NULL;
+}
+
+/* Stores bmp, which becomes owned by the cache, evicting the least recently
+ * used entries while over maxsize. The entry just stored is never evicted, so
+ * a bitmap bigger than the whole cache is still kept until the next call */
+void
+cacheput(Bitmapcache *c, const void *key, size_t keylen, Bitmap *bmp) {
+    Cacheentry *e = xmalloc(sizeof(*e));
+
+    e->key    = xmalloc(keylen);
+    e->keylen = keylen;
+    e->bmp    = bmp;
+    e->size   = sizeof(*bmp) + bmpimagesize(bmp) + keylen;
+    memcpy(e->key, key, keylen);
+
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head)
+        c->head->prev = e;
+    c->head = e;
+    if (!c->tail)
+        c->tail = e;
+    c->size += e->size;
+
+    while (c->size > c->maxsize && c->tail != c->head) {
+        Cacheentry *old = c->tail;
+
+        cacheunlink(c, old);
+        c->size -= old->size;
+        freebitmap(old->bmp);
+        free(old->key);
+        free(old);
+    }
+}
+
+/* Like bmpfromfile(), but going through covercache when it is enabled. The
+ * key is the path together with the file identity, so a cover replaced or
+ * modified in place misses and its stale entry just ages out */
+Bitmap *
+coverfromfile(const char *filename) {
+    struct {
+        Fileid id;
+        char   path[PATH_MAX];
+    } key;
+    struct stat st;
+
+    if (!covercache.maxsize)
+        return bmpfromfile(filename);
+
+    if (stat(filename, &st))
+        die("stat: couldn't stat %s\n", filename);
+    memset(&key, 0, sizeof(key));
+    key.id = (Fileid)
+        { .dev   = st.st_dev
+        , .ino   = st.st_ino
+        , .size  = st.st_size
+        , .mtime = st.st_mtim
+        };
+    size_t len = strnlen(filename, PATH_MAX);
+    memcpy(key.path, filename, len);
+    size_t keylen = sizeof(key.id) + len;
+
+    Bitmap *bp = cacheget(&covercache, &key, keylen);
+    if (!bp) {
+        bp = bmpfromfile(filename);
+        cacheput(&covercache, &key, keylen, bp);
+    }
+
+    return bp;
+}
+
+/* release a bitmap returned by coverfromfile() */
+void
+freecover(Bitmap *bp) {
+    if (!covercache.maxsize)
+        freebitmap(bp);
 }
 
-char **
-getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
-    struct dirent *d;
-    FILE *fp;
-    DIR *dp = xopendir(dir);
-    size_t i = 0;
-    char filepath[PATH_MAX] = {0};
-    char **filenames = xmalloc(sizeof(*filenames) * n);
+/* Called before the i-th of the n covers in paths is read: asks the kernel
+ * to read the next covers in the background, up to the prefetch depth ahead,
+ * so the disk works while the current one is being embedded. The automatic
+ * depth takes up to a quarter of the free memory. It's only a hint, so
+ * failures are left for the actual read to report */
+void
+prefetchcover(char **paths, size_t i, size_t n) {
+    static size_t depth;
+    size_t from = i + depth, to = i + depth + 1;
+    struct stat st;
 
-    while ((d = readdir(dp)) && i < n) {
-        if (d->d_type == DT_REG) {
-            size_t len = xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
-            fp = xfopen(filepath, "r");
-            if (isvalid(fp, k, size)) {
-                filenames[i] = xmalloc(len + 1UL);
-                strncpy(filenames[i], filepath, len);
-                filenames[i][len] = '\0'; /* NULL terminate string */
-                i++;
-            }
-            xfclose(fp);
+    if (directio || !prefetch)
+        return;
+    if (i == 0) {
+        depth = prefetch;
+        if (prefetch == -1 && !stat(paths[0], &st)) {
+            long pages = sysconf(_SC_AVPHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+            depth = pages > 0 && st.st_size ? (uint64_t)pages * pagesize / 4 / st.st_size : 1;
         }
+        from = 1;
+        to   = 1 + depth;
     }
-    xclosedir(dp);
 
-    if (i < n)
-        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
-
-    return filenames;
+    for (size_t j = from; j < to && j < n; j++)
+        prefetchfile(paths[j]);
 }
 
-char **
-getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size) {
-    return getvalidfilenames(dir, k, n, isvalidbmp, size);
+/* asks the kernel to start reading path in the background */
+void
+prefetchfile(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
 }
 
-char **
-getshadowfilenames(const char *dir, uint16_t k, uint32_t size) {
-    return getvalidfilenames(dir, k, k, isvalidshadow, size);
+/* generate the keystream of ks up to len bytes, in memory */
+void
+extendkeystream(Keystream *ks, size_t len) {
+    ks->bytes = realloc(ks->bytes, len);
+    if (!ks->bytes)
+        die("realloc: couldn't allocate %zu bytes\n", len);
+
+    lcgfill(&ks->lcg, ks->bytes + ks->len, len - ks->len);
+    ks->len = len;
 }
 
+/* map the cache file of ks, generating and appending whatever is missing to
+ * reach len bytes. The file is locked while it grows, so that concurrent
+ * processes sharing the directory don't interleave their writes */
 void
-distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed) {
-    Bitmap *bmp, **shadows;
+extendkeystreamfile(Keystream *ks, size_t len) {
+    char path[PATH_MAX];
+    KeycacheHeader h;
+    Lcg g;
 
-    bmp = bmpfromfile(imgpath);
-    char ** filepaths = getbmpfilenames(dir, k, n, bmpimagesize(bmp));
-    xorbmpwithrandomtable(bmp, seed);
-    shadows = formshadows(bmp, k, n, seed);
-    freebitmap(bmp);
+    if (ks->map)
+        munmap(ks->map, ks->maplen);
 
-    for (size_t i = 0; i < n; i++) {
-        bmp = bmpfromfile(filepaths[i]);
-        hideshadow(bmp, shadows[i]);
-        freebitmap(bmp);
+    xsnprintf(path, PATH_MAX, "%.*s/lcg48-%u.ks", DIR_MAX, keycachedir, ks->seed);
+    int fd = xopen(path, O_RDWR | O_CREAT, 0644);
+    if (flock(fd, LOCK_EX))
+        die("flock: couldn't lock %s\n", path);
+
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h)
+            || memcmp(h.magic, KEYCACHE_MAGIC, sizeof(h.magic))
+            || h.engine != KEYSTREAM_LCG48) {
+        lcgseed(&g, ks->seed);
+        memcpy(h.magic, KEYCACHE_MAGIC, sizeof(h.magic));
+        h.engine = KEYSTREAM_LCG48;
+        h.state  = g.state;
+        h.len    = 0;
     }
 
-    for (size_t i = 0; i < n; i++) {
-        free(filepaths[i]);
-        freebitmap(shadows[i]);
+    size_t cached = h.len;
+    if (cached < len) {
+        h.len = len;
+        if (ftruncate(fd, sizeof(h) + len))
+            die("ftruncate: couldn't grow %s\n", path);
     }
-    free(filepaths);
-    free(shadows);
-}
 
-void
-recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
-    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+    ks->maplen = sizeof(h) + h.len;
+    ks->map    = mmap(NULL, ks->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ks->map == MAP_FAILED)
+        die("mmap: couldn't map %s\n", path);
+    ks->bytes = ks->map + sizeof(h);
 
-    char **filepaths = getshadowfilenames(dir, k, width * height);
-    for (size_t i = 0; i < k; i++) {
-        Bitmap *bp = bmpfromfile(filepaths[i]);
-        shadows[i] = retrieveshadow(bp, width, height, k);
-        freebitmap(bp);
+    if (cached < len) {
+        g.state = h.state;
+        lcgfill(&g, ks->bytes + cached, len - cached);
+        h.state = g.state;
+        memcpy(ks->map, &h, sizeof(h));
     }
+    ks->lcg.state = h.state;
+    ks->len       = h.len;
 
-    Bitmap *bmp = revealsecret(shadows, width, height, k);
-    bmptofile(bmp, filename);
-    freebitmap(bmp);
+    flock(fd, LOCK_UN);
+    xclose(fd);
+}
 
-    for (size_t i = 0; i < k; i++) {
-        free(filepaths[i]);
-        freebitmap(shadows[i]);
+/* Returns at least the first len bytes of the keystream for seed. Streams are
+ * kept for the life of the process, and in keycachedir when one was given, so
+ * jobs sharing a seed only pay for the part of the stream not seen before */
+const uint8_t *
+keystream(uint16_t seed, size_t len) {
+    Keystream *ks = NULL;
+
+    for (size_t i = 0; i < KEYCACHE_ENTRIES && !ks; i++)
+        if (keycache[i].len && keycache[i].seed == seed)
+            ks = &keycache[i];
+
+    if (ks && ks->len >= len)
+        stats.keystreamhits++;
+    else
+        stats.keystreammisses++;
+    if (!ks) {
+        ks = &keycache[keycachenext];
+        keycachenext = (keycachenext + 1) % KEYCACHE_ENTRIES;
+        dropkeystream(ks);
+        *ks = (Keystream) { .seed = seed };
+        lcgseed(&ks->lcg, seed);
     }
-    free(filepaths);
-    free(shadows);
-}
 
-uint8_t *
-randomtable(uint32_t tablesize, uint16_t seed) {
-    uint8_t *table = xmalloc(tablesize * sizeof(*table));
-    setseed(seed);
+    if (ks->len < len) {
+        if (keycachedir)
+            extendkeystreamfile(ks, len);
+        else
+            extendkeystream(ks, len);
+    }
+
+    return ks->bytes;
+}
 
-    if (table)
-        for (size_t i = 0; i < tablesize; i++)
-            table[i] = nextbyte();
+/* unmaps or frees the cached bytes of ks */
+void
+dropkeystream(Keystream *ks) {
+    if (ks->map)
+        munmap(ks->map, ks->maplen);
+    else
+        free(ks->bytes);
+    *ks = (Keystream) { 0 };
+}
 
-    return table;
+/* Makes dir the --keycache directory. The streams cached so far live in the
+ * previous store, mapped from its files or in memory, so they are released
+ * rather than extended in the new one */
+void
+setkeycache(const char *dir) {
+    if (keycachedir && strcmp(keycachedir, dir) == 0)
+        return;
+    for (size_t i = 0; i < KEYCACHE_ENTRIES; i++)
+        dropkeystream(&keycache[i]);
+    keycachenext = 0;
+    free((char *)keycachedir);
+    keycachedir = xstrdup(dir);
 }
 
 void
 xorbmpwithrandomtable(Bitmap *bmp, uint16_t seed) {
-    uint32_t imgsize = bmpimagesize(bmp);
-    uint8_t *table   = randomtable(imgsize, seed);
+    uint32_t imgsize     = bmpimagesize(bmp);
+    const uint8_t *table = keystream(seed, imgsize);
 
     for (size_t i = 0; i < imgsize; i++)
         bmp->imgpixels[i] ^= table[i];
+}
 
-    free(table);
+void
+initoptions(Options *o) {
+    *o = (Options)
+        { .seed = DEFAULT_SEED
+        , .dir  = "./"
+        };
 }
 
-int
-main(int argc, char *argv[argc + 1]) {
-    bool dflag      = 0;
-    bool rflag      = 0;
-    bool kflag      = 0;
-    bool wflag      = 0;
-    bool hflag      = 0;
-    bool nflag      = 0;
-    bool secretflag = 0;
-    uint16_t seed   = DEFAULT_SEED;
-    uint16_t k      = 0;
-    uint16_t n      = 0;
-    uint32_t width  = 0;
-    int32_t height  = 0;
-    char *filename  = 0;
-    char *dir       = "./";
+/* argv holds only the options, without the program name */
+void
+parseargs(Options *o, int argc, char *argv[]) {
     char *endptr;
 
-    argv0 = argv[0]; /* save program name for usage() */
-
-    for (size_t i = 1; i < argc; i++) {
+    for (size_t i = 0; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0) {
-            dflag = 1;
+            o->dflag = 1;
         } else if (strcmp(argv[i], "-r") == 0) {
-            rflag = 1;
+            o->rflag = 1;
+        } else if (strcmp(argv[i], "--tile") == 0) {
+            o->tile = 1;
+        } else if (strcmp(argv[i], "--sequence") == 0) {
+            o->sequence = 1;
+        } else if (strcmp(argv[i], "--update") == 0) {
+            o->uflag = 1;
+        } else if (strcmp(argv[i], "--reshare") == 0) {
+            o->reshareflag = 1;
+        } else if (strcmp(argv[i], "--newk") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l <= UINT16_MAX)
+                    o->newk = l;
+                else
+                    die("newk must be 2 <= newk <= %d; was %d", UINT16_MAX, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--covers") == 0) {
+            if (i + 1 < argc) {
+                o->covers = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--digest") == 0) {
+            if (i + 1 < argc) {
+                o->digest = argv[++i];
+            } else {
+                usage();
+            }
         } else if (strcmp(argv[i], "--secret") == 0) {
-            secretflag = 1;
+            o->secretflag = 1;
+            if (o->nsecrets == MULTI_MAX_SECRETS)
+                die("at most %d secrets can be shared at once\n", MULTI_MAX_SECRETS);
+            if (i + 1 < argc) {
+                o->secrets[o->nsecrets++] = argv[++i];
+                o->filename = o->secrets[0];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--index") == 0) {
             if (i + 1 < argc) {
-                filename = argv[++i];
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (1 <= l && l <= MULTI_MAX_SECRETS)
+                    o->index = l;
+                else
+                    die("index must be 1 <= index <= %d; was %d", MULTI_MAX_SECRETS, l);
             } else {
                 usage();
             }
         } else if (strcmp(argv[i], "-k") == 0) {
-            kflag = 1;
+            o->kflag = 1;
             if (i + 1 < argc) {
                 long int l = xstrtol(argv[++i], &endptr, 10);
                 if (l <= UINT16_MAX)
-                    k = l;
+                    o->k = l;
                 else
                     die("k must be 2 <= k <= %d; was %d", UINT16_MAX, l);
             } else {
                 usage();
             }
         } else if (strcmp(argv[i], "-w") == 0) {
-            wflag = 1;
+            o->wflag = 1;
             if (i + 1 < argc) {
                 long int l = xstrtol(argv[++i], &endptr, 10);
                 if (l <= UINT32_MAX)
-                    width = l;
+                    o->width = l;
                 else
                     die("width must be less or equal to %d; was %d", UINT32_MAX, l);
             } else {
                 usage();
             }
         } else if (strcmp(argv[i], "-h") == 0) {
-            hflag = 1;
+            o->hflag = 1;
             if (i + 1 < argc) {
                 long int l = xstrtol(argv[++i], &endptr, 10);
                 if (INT32_MIN <= l && l <= INT32_MAX)
-                    height = l;
+                    o->height = l;
                 else
                     die("height must be %d <= height <= %d; was %d", INT32_MIN, INT32_MAX, l);
             } else {
@@ -792,18 +3940,18 @@ main(int argc, char *argv[argc + 1]) {
             if (i + 1 < argc) {
                 long int l = xstrtol(argv[++i], &endptr, 10);
                 if (l <= UINT16_MAX)
-                    seed = l;
+                    o->seed = l;
                 else
                     die("seed must be less or equal to %d; was %d", UINT16_MAX, l);
             } else {
                 usage();
             }
         } else if (strcmp(argv[i], "-n") == 0) {
-            nflag = 1;
+            o->nflag = 1;
             if (i + 1 < argc) {
                 long int l = xstrtol(argv[++i], &endptr, 10);
                 if (l <= UINT16_MAX)
-                    n = l;
+                    o->n = l;
                 else
                     die("n must be 2 <= n <= 65535; was %d", l);
             } else {
@@ -811,32 +3959,603 @@ main(int argc, char *argv[argc + 1]) {
             }
         } else if (strcmp(argv[i], "--dir") == 0) {
             if (i + 1 < argc) {
-                dir = argv[++i];
+                o->dir = argv[++i];
             } else{
                 usage();
             }
+        } else if (strcmp(argv[i], "--keycache") == 0) {
+            if (i + 1 < argc) {
+                setkeycache(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--covercache") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l < 0)
+                    die("covercache must be a positive amount of MiB; was %d", l);
+                covercache.maxsize = (size_t)l << 20;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--revealcache") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l < 0)
+                    die("revealcache must be a positive amount of MiB; was %d", l);
+                revealcache.maxsize = (size_t)l << 20;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--name") == 0) {
+            if (i + 1 < argc)
+                nametemplate = xstrdup(argv[++i]);
+            else
+                usage();
+        } else if (strcmp(argv[i], "--job") == 0) {
+            if (i + 1 < argc)
+                jobid = xstrdup(argv[++i]);
+            else
+                usage();
+        } else if (strcmp(argv[i], "--sync") == 0) {
+            if (i + 1 >= argc)
+                usage();
+            i++;
+            if (strcmp(argv[i], "none") == 0)
+                syncmode = SYNC_NONE;
+            else if (strcmp(argv[i], "batch") == 0)
+                syncmode = SYNC_BATCH;
+            else if (strcmp(argv[i], "fs") == 0)
+                syncmode = SYNC_FS;
+            else if (strcmp(argv[i], "file") == 0)
+                syncmode = SYNC_FILE;
+            else
+                die("--sync must be none, batch, fs or file; was %s\n", argv[i]);
+        } else if (strcmp(argv[i], "--priority") == 0 || strcmp(argv[i], "--deadline") == 0) {
+            /* taken by readjob() when the job is queued */
+            if (++i >= argc)
+                usage();
+        } else if (strcmp(argv[i], "--recursive") == 0) {
+            recursive = 1;
+        } else if (strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) {
+            bool include = argv[i][2] == 'i';
+            if (i + 1 >= argc)
+                usage();
+            if ((include ? nincludes : nexcludes) == MAX_GLOBS)
+                die("at most %d globs can be given to %s\n", MAX_GLOBS, argv[i]);
+            if (include)
+                includes[nincludes++] = xstrdup(argv[++i]);
+            else
+                excludes[nexcludes++] = xstrdup(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 < argc)
+                metricspath = xstrdup(argv[++i]);
+            else
+                usage();
+        } else if (strcmp(argv[i], "--memlimit") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l < 0)
+                    die("memlimit must be a positive amount of MiB; was %ld\n", l);
+                memlimit = (size_t)l << 20;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l < 0)
+                    die("rate must be a positive amount of KiB/s; was %ld\n", l);
+                ratelimit = (double)l * 1024;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--idle") == 0) {
+            setidle(true);
+        } else if (strcmp(argv[i], "--no-idle") == 0) {
+            setidle(false);
+        } else if (strcmp(argv[i], "--prefetch") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (l < 0)
+                    die("prefetch must be >= 0; was %ld\n", l);
+                prefetch = l;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (1 <= l && l <= MAX_THREADS)
+                    nthreads = l;
+                else
+                    die("threads must be 1 <= threads <= %d; was %d", MAX_THREADS, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            directio = 1;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pinthreads = 1;
+        } else if (strcmp(argv[i], "--placement") == 0) {
+            placement = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            if (batchpath)
+                die("--batch can't be nested or repeated\n");
+            if (i + 1 < argc) {
+                batchpath = argv[++i];
+            } else {
+                usage();
+            }
         } else {
             die("invalid %s parameter \n", argv[i]);
         }
     }
+}
+
+void
+runjob(Options *o) {
+    /* --reshare has no image file: the secret only lives in memory */
+    if (o->reshareflag) {
+        if (o->dflag || o->rflag || o->uflag || o->tile)
+            die("can't use --reshare together with -d, -r, --update or --tile\n");
+        if (!o->kflag || !o->newk || !o->covers || !o->wflag || !o->hflag || !o->width || !o->height)
+            die("--reshare needs -k, --newk, --covers, -w and -h\n");
+        if (!o->nflag)
+            o->n = countfiles(o->covers, minsize(o->width * abs(o->height), o->newk));
+        if (o->newk > o->n || o->newk < 2 || o->k < 2)
+            die("k, newk and n must be: 2 <= k, 2 <= newk <= n\n");
+        reshareimage(o->dir, o->covers, o->width, o->height, o->k, o->newk, o->n, o->seed);
+        return;
+    }
 
-    if (!(dflag || rflag) || !secretflag || !kflag)
+    if (!(o->dflag || o->rflag || o->uflag) || !o->secretflag || !o->kflag)
         usage();
-    if ((rflag && !(wflag && hflag)) || !width || !height)
+    /* with --index, the dimensions are in the shadows */
+    if (!(o->rflag && o->index)
+            && ((o->rflag && !(o->wflag && o->hflag)) || !o->width || !o->height))
         die("specify a positive width and height with -w -h for the revealed image\n");
+    if (o->dflag + o->rflag + o->uflag > 1)
+        die("can't use more than one of -d, -r and --update\n");
+    if (o->nsecrets > 1 && (!o->dflag || o->digest || o->tile))
+        die("several --secret can only be given with -d, and without --digest or --tile\n");
+    if (o->tile && !o->dflag)
+        die("--tile only applies to -d; the layout is recorded in the shadows\n");
+    if (o->sequence && (o->uflag || o->nsecrets > 1 || o->digest || o->tile || o->index))
+        die("--sequence takes a single --secret, and can't be used with --update, --digest, --tile or --index\n");
+
+    /* k, n and the seed come from the digest */
+    if (o->uflag) {
+        if (!o->digest)
+            die("--update needs the --digest written when distributing\n");
+        updateimage(o->dir, o->filename, o->digest, o->k);
+        return;
+    }
+
+    /* with -d, only covers big enough for the first secret (or frame) are
+     * counted. With -r, --secret is the output, which says nothing */
+    if (!o->nflag) {
+        const char *secret = o->filename;
+        char first[PATH_MAX];
+        off_t pixels = 0;
 
-    if (!nflag)
-        n = countfiles(dir);
+        if (o->sequence) {
+            expandname(first, o->filename, 1);
+            secret = first;
+        }
+        if (o->dflag)
+            pixels = sharedbytes(secret);
+
+        o->n = countfiles(o->dir, minsize(pixels, o->k));
+    }
 
-    if (k > n || k < 2 || n < 2)
+    if (o->k > o->n || o->k < 2 || o->n < 2)
         die("k and n must be: 2 <= k <= n\n");
-    if (dflag && rflag)
-        die("can't use -d and -r flags simultaneously\n");
 
-    if (dflag)
-        distributeimage(dir, filename, k, n, seed);
-    else if (rflag)
-        recoverimage(dir, filename, width, height, k);
+    if (o->dflag && o->sequence)
+        distributesequence(o->dir, o->filename, o->k, o->n, o->seed);
+    else if (o->rflag && o->sequence)
+        recoversequence(o->dir, o->filename, o->width, o->height, o->k);
+    else if (o->dflag && o->nsecrets > 1)
+        distributeimages(o->dir, o->secrets, o->nsecrets, o->k, o->n, o->seed);
+    else if (o->dflag)
+        distributeimage(o->dir, o->filename, o->k, o->n, o->seed, o->digest, o->tile);
+    else if (o->rflag && o->index)
+        recoverimageat(o->dir, o->filename, o->k, o->index);
+    else if (o->rflag)
+        recoverimage(o->dir, o->filename, o->width, o->height, o->k);
+}
+
+/* seconds on CLOCK_MONOTONIC */
+double
+monotonic(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Rough peak of the memory a job takes: the pixels it holds at once, from
+ * the sizes of its inputs. Covers in covercache are not counted here */
+size_t
+footprint(const Options *o) {
+    struct stat st;
+    size_t pixels = (size_t)o->width * abs(o->height);
+    size_t n      = o->nflag ? o->n : o->k;
+
+    if (o->reshareflag) /* k stegos and n shadows, in stripes, plus a cover */
+        return pixels * 8 + pixels * n / o->newk + pixels * 8 / o->newk;
+    if (o->rflag)       /* k stegos of 8 pixels per shadow byte, the shadows,
+                         * the image and its keystream */
+        return pixels * 11;
+
+    /* a sequence holds a frame at a time */
+    size_t secret = 0;
+    for (size_t i = 0; i < o->nsecrets; i++) {
+        char first[PATH_MAX];
+
+        if (o->sequence)
+            expandname(first, o->secrets[i], 1);
+        if (!stat(o->sequence ? first : o->secrets[i], &st))
+            secret += st.st_size;
+    }
+    /* the secret and its keystream, n shadows, and a cover with its stego */
+    return secret * 2 + secret * n / o->k + secret * 16 / o->k;
+}
+
+/* Reads the next line of a batch that isn't empty or a comment, and takes
+ * --priority and --deadline (ms from now) from it. NULL at the end */
+Job *
+readjob(FILE *fp) {
+    Job *job = xmalloc(sizeof(*job));
+    size_t size;
+    char *endptr;
+
+    *job = (Job) { .line = NULL };
+    while (!job->nargs) {
+        if (getline(&job->line, &size, fp) == -1) {
+            free(job->line);
+            free(job);
+            return NULL;
+        }
+        for (char *tok = strtok(job->line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            if (job->nargs == BATCH_MAX_ARGS)
+                die("batch: more than %d arguments in a line\n", BATCH_MAX_ARGS);
+            job->args[job->nargs++] = tok;
+        }
+        if (job->nargs && job->args[0][0] == '#')
+            job->nargs = 0;
+    }
+
+    for (int i = 0; i < job->nargs; i++) {
+        const char *arg = job->args[i];
+
+        if (!strcmp(arg, "-d") || !strcmp(arg, "-r") || !strcmp(arg, "--update")
+                || !strcmp(arg, "--reshare")) {
+            job->isjob = true;
+        } else if (!strcmp(arg, "--priority") && i + 1 < job->nargs) {
+            job->priority = xstrtol(job->args[++i], &endptr, 10);
+        } else if (!strcmp(arg, "--deadline") && i + 1 < job->nargs) {
+            long int ms = xstrtol(job->args[++i], &endptr, 10);
+            if (ms <= 0)
+                die("deadline must be a positive amount of ms; was %ld\n", ms);
+            job->deadline = monotonic() + ms / 1e3;
+        }
+    }
+
+    return job;
+}
+
+/* Index of the job of queue to run next: the highest priority first and,
+ * within a priority, the earliest deadline, then the earliest to arrive */
+size_t
+nextjob(const Job *queue, size_t len) {
+    size_t best = 0;
+
+    for (size_t i = 1; i < len; i++) {
+        const Job *a = &queue[i], *b = &queue[best];
+
+        if (a->priority != b->priority) {
+            if (a->priority > b->priority)
+                best = i;
+        } else if (a->deadline != b->deadline) {
+            if (a->deadline && (!b->deadline || a->deadline < b->deadline))
+                best = i;
+        } else if (a->seq < b->seq) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+/* adds an observation of seconds to the histogram name{labels} */
+void
+observe(const char *name, const char *labels, double seconds) {
+    Histogram *h = NULL;
+    size_t i = 0;
+
+    for (size_t j = 0; j < stats.nhists && !h; j++)
+        if (!strcmp(stats.hists[j].name, name) && !strcmp(stats.hists[j].labels, labels))
+            h = &stats.hists[j];
+    if (!h) {
+        stats.hists = realloc(stats.hists, sizeof(*stats.hists) * (stats.nhists + 1));
+        if (!stats.hists)
+            die("realloc: out of memory\n");
+        h = &stats.hists[stats.nhists++];
+        memset(h, 0, sizeof(*h));
+        xsnprintf(h->name, sizeof(h->name), "%s", name);
+        xsnprintf(h->labels, sizeof(h->labels), "%s", labels);
+    }
+
+    for (double bound = HIST_MIN; i < HIST_BUCKETS && seconds > bound; bound *= 2)
+        i++;
+    h->buckets[i]++;
+    h->count++;
+    h->sum += seconds;
+}
+
+/* Records the latency of a finished job, by operation and k/n class, and the
+ * time it spent in each stage */
+void
+recordjob(const Options *o, double seconds) {
+    static const char *stages[STAGES] = { "read", "kernel", "write" };
+    const char *op = o->reshareflag ? "reshare" : o->uflag ? "update"
+                   : o->dflag ? "distribute" : "recover";
+    uint16_t k = o->reshareflag ? o->newk : o->k;
+    uint16_t n = o->dflag || o->reshareflag ? o->n : 0;
+    char labels[96];
+
+    xsnprintf(labels, sizeof(labels), "op=\"%s\",k=\"%d\",n=\"%d\"", op, k, n);
+    observe("bmpsss_job_seconds", labels, seconds);
+    for (size_t i = 0; i < STAGES; i++) {
+        xsnprintf(labels, sizeof(labels), "op=\"%s\",stage=\"%s\"", op, stages[i]);
+        observe("bmpsss_stage_seconds", labels, stats.stage[i]);
+        stats.stage[i] = 0;
+    }
+}
+
+/* writes the series of h, with cumulative buckets */
+void
+writehistogram(FILE *fp, const Histogram *h) {
+    uint64_t cumulative = 0;
+    double bound = HIST_MIN;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++, bound *= 2) {
+        cumulative += h->buckets[i];
+        fprintf(fp, "%s_bucket{%s,le=\"%g\"} %" PRIu64 "\n", h->name, h->labels, bound, cumulative);
+    }
+    fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", h->name, h->labels, h->count);
+    fprintf(fp, "%s_sum{%s} %g\n%s_count{%s} %" PRIu64 "\n", h->name, h->labels, h->sum,
+            h->name, h->labels, h->count);
+}
+
+/* Rewrites --metrics in the Prometheus text format. It is written aside and
+ * renamed, so a scraper never reads it half written */
+void
+writemetrics(void) {
+    const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        uint64_t   value;
+    } counters[] =
+        { { "bmpsss_read_bytes_total", "counter", "Bytes of images read.", stats.bytesread }
+        , { "bmpsss_written_bytes_total", "counter", "Bytes of images written.", stats.byteswritten }
+        , { "bmpsss_keystream_hits_total", "counter", "Keystreams found in memory.", stats.keystreamhits }
+        , { "bmpsss_keystream_misses_total", "counter", "Keystreams generated or extended.", stats.keystreammisses }
+        , { "bmpsss_covercache_hits_total", "counter", "Covers found in --covercache.", covercache.hits }
+        , { "bmpsss_covercache_misses_total", "counter", "Covers read from disk with --covercache.", covercache.misses }
+        , { "bmpsss_revealcache_hits_total", "counter", "Recoveries found in --revealcache.", revealcache.hits }
+        , { "bmpsss_revealcache_misses_total", "counter", "Recoveries computed with --revealcache.", revealcache.misses }
+        , { "bmpsss_rejected_jobs_total", "counter", "Batch jobs rejected by --memlimit.", stats.rejected }
+        , { "bmpsss_late_jobs_total", "counter", "Batch jobs that missed their --deadline.", stats.late }
+        , { "bmpsss_queued_jobs", "gauge", "Batch jobs waiting to run.", stats.queued }
+        };
+
+    if (!metricspath)
+        return;
+
+    char *tmp = tmpname(metricspath);
+    FILE *fp  = xfopen(tmp, "w");
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++)
+        fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", counters[i].name,
+                counters[i].help, counters[i].name, counters[i].type, counters[i].name,
+                counters[i].value);
+
+    /* the series of a histogram must come together, after its TYPE */
+    for (size_t i = 0; i < stats.nhists; i++) {
+        const Histogram *h = &stats.hists[i];
+        size_t first = 0;
+
+        while (strcmp(stats.hists[first].name, h->name))
+            first++;
+        if (first < i)
+            continue;
+        fprintf(fp, "# TYPE %s histogram\n", h->name);
+        for (size_t j = i; j < stats.nhists; j++)
+            if (!strcmp(stats.hists[j].name, h->name))
+                writehistogram(fp, &stats.hists[j]);
+    }
+
+    xfclose(fp);
+    if (rename(tmp, metricspath))
+        die("rename: couldn't rename %s to %s\n", tmp, metricspath);
+    free(tmp);
+}
+
+/* frees the globs given after the first nincl --include and nexcl --exclude */
+void
+dropglobs(size_t nincl, size_t nexcl) {
+    while (nincludes > nincl)
+        free(includes[--nincludes]);
+    while (nexcludes > nexcl)
+        free(excludes[--nexcludes]);
+}
+
+Jobsettings
+getsettings(void) {
+    return (Jobsettings)
+        { .nthreads     = nthreads
+        , .pinthreads   = pinthreads
+        , .placement    = placement
+        , .directio     = directio
+        , .prefetch     = prefetch
+        , .syncmode     = syncmode
+        , .nametemplate = nametemplate
+        , .ratelimit    = ratelimit
+        , .recursive    = recursive
+        , .nincludes    = nincludes
+        , .nexcludes    = nexcludes
+        };
+}
+
+/* undoes what a job line set since getsettings() returned js, along with its
+ * --job */
+void
+putsettings(const Jobsettings *js) {
+    if (nametemplate != js->nametemplate)
+        free((char *)nametemplate);
+    free((char *)jobid);
+    dropglobs(js->nincludes, js->nexcludes);
+
+    nthreads     = js->nthreads;
+    pinthreads   = js->pinthreads;
+    placement    = js->placement;
+    directio     = js->directio;
+    prefetch     = js->prefetch;
+    syncmode     = js->syncmode;
+    nametemplate = js->nametemplate;
+    ratelimit    = js->ratelimit;
+    recursive    = js->recursive;
+    jobid        = NULL;
+}
+
+/* Runs a queued job, unless its predicted footprint plus the caches would
+ * go over --memlimit, in which case it is rejected with a warning. What the
+ * job line itself sets, such as --name, --threads or --include, is its own:
+ * the settings of the options lines are back in place for the next job */
+void
+runqueued(Job *job) {
+    Options o;
+    Jobsettings saved = getsettings();
+
+    free((char *)jobid); /* a --job of an options line names no job */
+    jobid  = NULL;
+    jobseq = job->seq;
+    initoptions(&o);
+    parseargs(&o, job->nargs, job->args);
+
+    size_t need = footprint(&o);
+    if (memlimit && need + covercache.maxsize + revealcache.maxsize > memlimit) {
+        fprintf(stderr, "batch: job %zu rejected: needs about %zu MiB over --memlimit\n",
+                job->seq, (need >> 20) + 1);
+        stats.rejected++;
+        writemetrics();
+        putsettings(&saved);
+        return;
+    }
+
+    double start = monotonic();
+    runjob(&o);
+    syncoutputs();
+    recordjob(&o, monotonic() - start);
+
+    double late = job->deadline ? monotonic() - job->deadline : 0;
+    if (late > 0) {
+        fprintf(stderr, "batch: job %zu missed its deadline by %.0f ms\n", job->seq, late * 1e3);
+        stats.late++;
+    }
+    writemetrics();
+    putsettings(&saved);
+}
+
+/* Runs every job in path ("-" for stdin), one per line, with the same options
+ * as the command line. Empty lines and lines starting with '#' are skipped.
+ * Jobs are queued as they arrive and run by nextjob() order, so urgent ones
+ * go ahead of those submitted before them. A line with only options waits
+ * for the jobs queued before it to finish, and applies to the jobs after it */
+void
+runbatch(const char *path) {
+    FILE *fp    = strcmp(path, "-") ? xfopen(path, "r") : stdin;
+    Job *queue  = NULL, *held = NULL;
+    size_t len  = 0, seq = 0;
+    bool eof    = false;
+
+    /* jobs may keep coming for a long while, so covers are looked up in an
+     * index kept current by inotify instead of rescanning their directory.
+     * Without inotify, every job just scans again */
+    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    /* unbuffered, so that poll() sees every line that wasn't read yet */
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    while (!eof || len || held) {
+        /* take in every job already submitted; block only with none queued */
+        while (!eof && !held) {
+            struct pollfd pfd = { .fd = fileno(fp), .events = POLLIN };
+            if (len && poll(&pfd, 1, 0) == 0)
+                break;
+
+            Job *job = readjob(fp);
+            if (!job) {
+                eof = true;
+            } else if (!job->isjob) {
+                held = job;
+            } else {
+                job->seq = ++seq;
+                queue = realloc(queue, sizeof(*queue) * (len + 1));
+                if (!queue)
+                    die("realloc: out of memory\n");
+                queue[len++] = *job;
+                free(job);
+            }
+        }
+
+        if (len) {
+            size_t i = nextjob(queue, len);
+            Job job  = queue[i];
+
+            queue[i]     = queue[--len];
+            stats.queued = len;
+            runqueued(&job);
+            free(job.line);
+        } else if (held) {
+            Options o;
+
+            initoptions(&o);
+            parseargs(&o, held->nargs, held->args);
+            free(held->line);
+            free(held);
+            held = NULL;
+        }
+    }
+    free(queue);
+    if (fp != stdin)
+        xfclose(fp);
+}
+
+int
+main(int argc, char *argv[argc + 1]) {
+    Options o;
+
+    argv0 = argv[0]; /* save program name for usage() */
+
+    initoptions(&o);
+    parseargs(&o, argc - 1, argv + 1);
+
+    if (batchpath) {
+        if (o.dflag || o.rflag || o.uflag || o.reshareflag)
+            die("can't use -d, -r, --update or --reshare together with --batch\n");
+        runbatch(batchpath);
+    } else {
+        double start = monotonic();
+        runjob(&o);
+        syncoutputs();
+        recordjob(&o, monotonic() - start);
+        writemetrics();
+    }
 
     return EXIT_SUCCESS;
 }
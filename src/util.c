@@ -1,11 +1,15 @@
+#include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -35,6 +39,22 @@ xfclose(FILE *fp) {
         die("fclose: error\n");
 }
 
+int
+xopen(const char *path, int flags, mode_t mode) {
+    int fd = open(path, flags, mode);
+
+    if (fd == -1)
+        die("open: couldn't open %s\n", path);
+
+    return fd;
+}
+
+void
+xclose(int fd) {
+    if (close(fd))
+        die("close: error\n");
+}
+
 void
 xfread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     if (fread(ptr, size, nmemb, stream) < 1)
@@ -81,6 +101,16 @@ xmalloc(size_t size) {
     return p;
 }
 
+char *
+xstrdup(const char *s) {
+    char *p = strdup(s);
+
+    if (!p)
+        die("xstrdup: couldn't allocate %zu bytes\n", strlen(s) + 1);
+
+    return p;
+}
+
 size_t
 xsnprintf(char *str, size_t size, const char *fmt, ...) {
     va_list ap;
@@ -115,6 +145,44 @@ mod(int a, int b) {
     return m < 0 ? m + b : m;
 }
 
+static uint64_t
+rotl64(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+/* Fast non-cryptographic hash in the style of xxh64: every word is multiplied
+ * and rotated before it is folded in, so each input bit reaches all of the
+ * output. Different seeds give independent hashes of the same bytes. */
+uint64_t
+hash64(const void *buf, size_t len, uint64_t seed) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t p3 = 0x165667B19E3779F9ULL;
+    const uint64_t p4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t p5 = 0x27D4EB2F165667C5ULL;
+    const uint8_t *p  = buf;
+    uint64_t h = seed + p5 + len;
+    uint64_t w;
+
+    for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        h ^= rotl64(w * p2, 31) * p1;
+        h  = rotl64(h, 27) * p1 + p4;
+    }
+    for (; len; len--, p++) {
+        h ^= *p * p5;
+        h  = rotl64(h, 11) * p1;
+    }
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+
+    return h;
+}
+
 inline void
 uint16swap(uint16_t *x) {
     *x = *x >> 8 | *x << 8;
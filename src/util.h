@@ -1,16 +1,20 @@
 void     die(const char *errstr, ...);
 void     xfclose(FILE *fp);
 FILE     *xfopen(const char *filename, const char *mode);
+int      xopen(const char *path, int flags, mode_t mode);
+void     xclose(int fd);
 void     xfread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 void     xfwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 void     xfseek(FILE *fp, long offset, int whence);
 DIR      *xopendir(const char *name);
 void     xclosedir(DIR *dirp);
 void     *xmalloc(size_t size);
+char     *xstrdup(const char *s);
 size_t   xsnprintf(char *str, size_t size, const char *fmt, ...);
 long int xstrtol(const char *nptr, char **end, int base);
 
 int  mod(int a, int b);
+uint64_t hash64(const void *buf, size_t len, uint64_t seed);
 
 bool isbigendian(void);
 void uint16swap(uint16_t *x);
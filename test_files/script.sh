@@ -8,3 +8,16 @@ mkdir -p outputs
 ../bin/bmpsss -r --secret outputs/output2.bmp -k 8 -w 300 -h 450 --dir imgs_300x450
 ../bin/bmpsss -r --secret outputs/output3.bmp -k 8 -w 300 -h 300 --dir imgs_300x300
 ../bin/bmpsss -r --secret outputs/output4.bmp -k 2 -w 600 -h 398 --dir imgs_600x1593
+
+# secrets whose pixel bytes aren't a multiple of k keep their last bytes,
+# packed ones (with up to 8 pixels a byte) their palette too
+mkdir -p tail-tmp/1 tail-tmp/4 tail-tmp/8
+../bin/bmpsss -d --secret tail1.bmp -w 64 -h 5 -k 3 -n 3 --dir imgs_300x300 --name tail-tmp/1/shadow%n.bmp
+../bin/bmpsss -r --secret outputs/tail1.bmp -k 3 -w 64 -h 5 --dir tail-tmp/1
+cmp -i 54 tail1.bmp outputs/tail1.bmp
+../bin/bmpsss -d --secret tail4.bmp -w 15 -h 5 -k 3 -n 3 --dir imgs_300x300 --name tail-tmp/4/shadow%n.bmp
+../bin/bmpsss -r --secret outputs/tail4.bmp -k 3 -w 15 -h 5 --dir tail-tmp/4
+cmp -i 54 tail4.bmp outputs/tail4.bmp
+../bin/bmpsss -d --secret tail8.bmp -w 8 -h 5 -k 3 -n 3 --dir imgs_300x300 --name tail-tmp/8/shadow%n.bmp
+../bin/bmpsss -r --secret outputs/tail8.bmp -k 3 -w 8 -h 5 --dir tail-tmp/8
+cmp -i 54 tail8.bmp outputs/tail8.bmp